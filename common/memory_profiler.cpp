@@ -0,0 +1,204 @@
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "memory_profiler.h"
+
+namespace {
+
+// Counters of a single stage.
+struct StageStats {
+    std::string name;
+    size_t live_bytes = 0;
+    size_t peak_bytes = 0;
+    size_t allocations = 0;
+    size_t pool_hits = 0;
+};
+
+// Stack of the stages entered by the current thread.
+thread_local std::vector<int> stage_stack;
+
+/**
+ * Allocator following cv::StdMatAllocator, with bookkeeping and an optional pool of free buffers.
+ */
+class StageAllocator : public cv::MatAllocator {
+
+public:
+
+    explicit StageAllocator(size_t pool_limit) : pool_limit(pool_limit) {
+        // Stage 0 collects allocations made outside any scope.
+        stageId("other");
+    }
+
+    int stageId(const std::string &name) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = stage_ids.find(name);
+        if (found != stage_ids.end())
+            return found->second;
+
+        int id = (int) stages.size();
+        stage_ids[name] = id;
+        stages.emplace_back();
+        stages.back().name = name;
+        return id;
+    }
+
+    cv::UMatData *allocate(int dims, const int *sizes, int type, void *data0, size_t *step,
+                           cv::AccessFlag /*flags*/, cv::UMatUsageFlags /*usage_flags*/) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; i--) {
+            if (step) {
+                if (data0 && step[i] != CV_AUTOSTEP)
+                    total = step[i];
+                else
+                    step[i] = total;
+            }
+            total *= sizes[i];
+        }
+
+        auto *u = new cv::UMatData(this);
+        u->size = total;
+
+        // Memory given by the user is not tracked.
+        if (data0) {
+            u->data = u->origdata = (uchar *) data0;
+            u->flags |= cv::UMatData::USER_ALLOCATED;
+            return u;
+        }
+
+        int stage = stage_stack.empty() ? 0 : stage_stack.back();
+        uchar *data = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            StageStats &stats = stages[stage];
+
+            // Reuse a pooled buffer of the same size if there is one.
+            auto pooled = pool.find(total);
+            if (pooled != pool.end() && !pooled->second.empty()) {
+                data = pooled->second.back();
+                pooled->second.pop_back();
+                pool_bytes -= total;
+                stats.pool_hits++;
+            }
+
+            stats.live_bytes += total;
+            stats.peak_bytes = std::max(stats.peak_bytes, stats.live_bytes);
+            stats.allocations++;
+            live_bytes += total;
+            peak_bytes = std::max(peak_bytes, live_bytes);
+        }
+        if (!data)
+            data = (uchar *) cv::fastMalloc(total);
+
+        u->data = u->origdata = data;
+        u->allocatorFlags_ = stage;
+        return u;
+    }
+
+    bool allocate(cv::UMatData *data, cv::AccessFlag /*access_flags*/,
+                  cv::UMatUsageFlags /*usage_flags*/) const override {
+        return data != nullptr;
+    }
+
+    void deallocate(cv::UMatData *u) const override {
+        if (!u)
+            return;
+
+        CV_Assert(u->urefcount == 0);
+        CV_Assert(u->refcount == 0);
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            bool keep = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stages[u->allocatorFlags_].live_bytes -= u->size;
+                live_bytes -= u->size;
+
+                // Keep the buffer if the pool has room for it.
+                if (pool_bytes + u->size <= pool_limit) {
+                    pool[u->size].push_back(u->origdata);
+                    pool_bytes += u->size;
+                    keep = true;
+                }
+            }
+            if (!keep)
+                cv::fastFree(u->origdata);
+            u->origdata = nullptr;
+        }
+        delete u;
+    }
+
+    void report(std::ostream &out) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "Memory by stage (MB):\n"
+            << std::left << std::setw(14) << "stage" << std::right
+            << std::setw(10) << "live" << std::setw(10) << "peak"
+            << std::setw(14) << "allocations" << std::setw(12) << "pool hits" << "\n";
+        for (auto &stats : stages) {
+            out << std::left << std::setw(14) << stats.name << std::right << std::fixed << std::setprecision(2)
+                << std::setw(10) << stats.live_bytes / 1048576.0
+                << std::setw(10) << stats.peak_bytes / 1048576.0
+                << std::setw(14) << stats.allocations
+                << std::setw(12) << stats.pool_hits << "\n";
+        }
+        out << "Total live: " << live_bytes / 1048576.0 << " MB, total peak: " << peak_bytes / 1048576.0
+            << " MB, pooled: " << pool_bytes / 1048576.0 << " MB." << std::endl;
+    }
+
+private:
+
+    mutable std::mutex mutex;
+    mutable std::map<std::string, int> stage_ids;
+    mutable std::vector<StageStats> stages;
+
+    // Overall counters, since stages overlap in time.
+    mutable size_t live_bytes = 0;
+    mutable size_t peak_bytes = 0;
+
+    // Free buffers by size.
+    size_t pool_limit;
+    mutable size_t pool_bytes = 0;
+    mutable std::map<size_t, std::vector<uchar *>> pool;
+
+};
+
+// Never deleted: Mats can be released during static destruction, after main returns.
+StageAllocator *allocator = nullptr;
+
+void reportAtExit() {
+    MemoryProfiler::report(std::cerr);
+}
+
+}
+
+void MemoryProfiler::install(size_t pool_bytes, bool report_at_exit) {
+    if (allocator)
+        return;
+
+    allocator = new StageAllocator(pool_bytes);
+    cv::Mat::setDefaultAllocator(allocator);
+    if (report_at_exit)
+        std::atexit(reportAtExit);
+}
+
+bool MemoryProfiler::installed() {
+    return allocator != nullptr;
+}
+
+void MemoryProfiler::report(std::ostream &out) {
+    if (allocator)
+        allocator->report(out);
+}
+
+MemoryScope::MemoryScope(const std::string &stage) {
+    active = MemoryProfiler::installed();
+    if (active)
+        stage_stack.push_back(allocator->stageId(stage));
+}
+
+MemoryScope::~MemoryScope() {
+    if (active)
+        stage_stack.pop_back();
+}
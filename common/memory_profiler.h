@@ -0,0 +1,64 @@
+#ifndef COMMON_MEMORY_PROFILER_H
+#define COMMON_MEMORY_PROFILER_H
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/**
+ * Opt-in instrumentation of the memory used by cv::Mat. Once installed, a custom cv::MatAllocator tags every allocation
+ * with the stage of the pipeline that is active on the allocating thread (see MemoryScope) and keeps live bytes, peak
+ * bytes and allocation counts for each stage. Optionally, freed buffers are kept in a pool and handed out again to
+ * allocations of the same size.
+ */
+class MemoryProfiler {
+
+public:
+
+    /**
+     * Install the profiler as OpenCV's default Mat allocator. Mats allocated before keep using the previous allocator.
+     * @param pool_bytes Freed buffers are pooled up to this many bytes in total. 0 disables the pool.
+     * @param report_at_exit If true, the report is printed on stderr when the program exits.
+     */
+    static void install(size_t pool_bytes = 0, bool report_at_exit = true);
+
+    /**
+     * @return True if the profiler has been installed.
+     */
+    static bool installed();
+
+    /**
+     * Print live bytes, peak bytes and allocation counts for each stage.
+     * @param out Where to print the report.
+     */
+    static void report(std::ostream &out);
+
+};
+
+/**
+ * Allocations made by the current thread while a scope is alive are attributed to its stage. Scopes can be nested, the
+ * innermost one wins. Allocations outside any scope are attributed to "other". Does nothing if the profiler is not
+ * installed.
+ */
+class MemoryScope {
+
+public:
+
+    /**
+     * @param stage Name of the stage, e.g. "projection" or "filtering".
+     */
+    explicit MemoryScope(const std::string &stage);
+
+    ~MemoryScope();
+
+    MemoryScope(const MemoryScope &) = delete;
+
+    MemoryScope &operator=(const MemoryScope &) = delete;
+
+private:
+
+    bool active;
+
+};
+
+#endif
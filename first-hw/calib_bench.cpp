@@ -0,0 +1,467 @@
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "calibration.h"
+
+using namespace std;
+using namespace cv;
+
+static void show_usage(const string &name) {
+    std::cerr << "Usage: " << name << " [options]\n"
+              << "Options:\n"
+              // Help option
+              << "\t-h, --help\t\tShow this help message.\n"
+              // Rendering options.
+              << "\t-z, --sizes LIST\tComma separated resolutions to benchmark, as WIDTHxHEIGHT."
+              << " Defaults to \"640x480,1280x960,1920x1440\".\n"
+              << "\t-n, --views N\t\tViews rendered for each resolution. Defaults to 20.\n"
+              << "\t-c, --columns WIDTH\tWidth (columns) of checkerboard pattern. Integer, defaults to 6.\n"
+              << "\t-r, --rows HEIGHT\tHeight (rows) of checkerboard pattern. Integer, defaults to 5.\n"
+              << "\t-g, --noise SIGMA\tStandard deviation of the gaussian noise, in gray levels. Defaults to 2.\n"
+              << "\t-b, --blur SIGMA\tStandard deviation of the gaussian blur, in pixels. Defaults to 0.8.\n"
+              << "\t-e, --seed N\t\tSeed of the random poses and noise. Defaults to 1.\n"
+              // Pipeline options.
+              << "\t-s, --search SIZE\tLongest side of the downscaled images on which corners are searched first."
+              << " 0 searches at full resolution. Defaults to 1024.\n"
+              << "\t-j, --threads N\t\tThreads used by each stage. Defaults to 0 (all cores)."
+              << std::endl;
+}
+
+// Options of a benchmark run.
+struct BenchOptions {
+    int views = 20;
+    Size pattern_size = Size(6, 5);
+    float unit_size = 0.11;
+    double noise = 2;
+    double blur = 0.8;
+    int seed = 1;
+    DetectionOptions detection;
+};
+
+// A rendered view and the truth about it.
+struct SyntheticView {
+    Mat image;
+    std::vector<Vec2f> corners;
+};
+
+/**
+ * @param list Comma separated resolutions, as WIDTHxHEIGHT.
+ * @return The resolutions.
+ * @throws invalid_argument if a resolution is malformed.
+ */
+vector<Size> parseSizes(const string &list);
+
+/**
+ * Compute, for each pixel of an image rendered at twice the resolution, the direction of the ray hitting it, as
+ * normalized coordinates (x / z, y / z) of the camera frame.
+ *
+ * @param camera_matrix The intrinsics.
+ * @param dist The distortion coefficients.
+ * @param size The resolution of the images.
+ * @return A CV_32FC2 matrix of twice the size.
+ */
+Mat cameraRays(const Mat &camera_matrix, const vector<double> &dist, const Size &size);
+
+/**
+ * Render a checkerboard seen by the camera from a random pose that keeps it all in the image.
+ *
+ * @param rays Result of cameraRays().
+ * @param camera_matrix The intrinsics.
+ * @param dist The distortion coefficients.
+ * @param size The resolution of the image.
+ * @param options Pattern, blur and noise.
+ * @param rng Source of the pose and the noise.
+ * @return The grayscale image and its exact corners.
+ */
+SyntheticView renderView(
+        const Mat &rays, const Mat &camera_matrix, const vector<double> &dist, const Size &size,
+        const BenchOptions &options, RNG &rng
+);
+
+/**
+ * @param found Corners found on a view.
+ * @param truth The exact corners.
+ * @return The RMS distance between them. The pattern may be found starting from either end, both are tried.
+ */
+double cornerError(const vector<Vec2f> &found, const vector<Vec2f> &truth);
+
+/**
+ * Render views at a resolution, run each stage of the calibration pipeline on them and print timings and errors.
+ *
+ * @param size The resolution.
+ * @param options The benchmark options.
+ */
+void runBenchmark(const Size &size, const BenchOptions &options);
+
+int main(int argc, char **argv) {
+    // Default options.
+    vector<Size> SIZES = {Size(640, 480), Size(1280, 960), Size(1920, 1440)};
+    BenchOptions OPTIONS;
+
+    // Command line arguments parsing ---
+    if (argc > 1) {
+        // Gave an option and no value.
+        if (argc < 3) {
+            show_usage(argv[0]);
+            return 1;
+        }
+        for (int i = 0; i < argc; i++) {
+            string arg = argv[i];
+
+            if ((arg == "-h") || (arg == "--help")) {
+                show_usage(argv[0]);
+                return 0;
+            } else if ((arg == "-z") || (arg == "--sizes")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the list.
+                SIZES = parseSizes(argv[++i]);
+            } else if ((arg == "-n") || (arg == "--views")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the number of views.
+                OPTIONS.views = stoi(argv[++i]);
+            } else if ((arg == "-c") || (arg == "--columns")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the width.
+                OPTIONS.pattern_size.width = stoi(argv[++i]);
+            } else if ((arg == "-r") || (arg == "--rows")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the height.
+                OPTIONS.pattern_size.height = stoi(argv[++i]);
+            } else if ((arg == "-g") || (arg == "--noise")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the deviation.
+                OPTIONS.noise = stod(argv[++i]);
+            } else if ((arg == "-b") || (arg == "--blur")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the deviation.
+                OPTIONS.blur = stod(argv[++i]);
+            } else if ((arg == "-e") || (arg == "--seed")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the seed.
+                OPTIONS.seed = stoi(argv[++i]);
+            } else if ((arg == "-s") || (arg == "--search")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the size.
+                OPTIONS.detection.search_size = stoi(argv[++i]);
+            } else if ((arg == "-j") || (arg == "--threads")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the number of threads.
+                OPTIONS.detection.threads = stoi(argv[++i]);
+            }
+        }
+    }
+
+    for (auto &size : SIZES)
+        runBenchmark(size, OPTIONS);
+
+    return 0;
+}
+
+vector<Size> parseSizes(const string &list) {
+    vector<Size> sizes;
+    size_t start = 0;
+    while (start < list.size()) {
+        size_t end = list.find(',', start);
+        if (end == string::npos)
+            end = list.size();
+        string item = list.substr(start, end - start);
+        size_t x = item.find('x');
+        if (x == string::npos)
+            throw invalid_argument("Malformed resolution " + item + ".");
+        sizes.emplace_back(stoi(item.substr(0, x)), stoi(item.substr(x + 1)));
+        start = end + 1;
+    }
+    return sizes;
+}
+
+Mat cameraRays(const Mat &camera_matrix, const vector<double> &dist, const Size &size) {
+    // Centers of the sub-pixels, in the coordinates of the full pixels.
+    Size fine(size.width * 2, size.height * 2);
+    Mat pixels(1, fine.area(), CV_32FC2);
+    Vec2f *pixel = pixels.ptr<Vec2f>();
+    for (int y = 0; y < fine.height; y++)
+        for (int x = 0; x < fine.width; x++)
+            *pixel++ = Vec2f((x + 0.5f) / 2 - 0.5f, (y + 0.5f) / 2 - 0.5f);
+
+    // Many iterations, since the truth has to be accurate.
+    Mat rays;
+    undistortPoints(
+            pixels, rays, camera_matrix, dist, noArray(), noArray(),
+            TermCriteria(TermCriteria::COUNT | TermCriteria::EPS, 50, 1e-9)
+    );
+    return rays.reshape(2, fine.height);
+}
+
+SyntheticView renderView(
+        const Mat &rays, const Mat &camera_matrix, const vector<double> &dist, const Size &size,
+        const BenchOptions &options, RNG &rng
+) {
+    int rows = options.pattern_size.height;
+    int columns = options.pattern_size.width;
+    double unit = options.unit_size;
+    double fx = camera_matrix.at<double>(0, 0);
+    double fy = camera_matrix.at<double>(1, 1);
+    double cx = camera_matrix.at<double>(0, 2);
+    double cy = camera_matrix.at<double>(1, 2);
+
+    // Outer corners of the board, quiet zone included. Board x runs along the rows, as in getObjectPoints().
+    vector<Vec3f> outline = {
+            Vec3f((float) (-2 * unit), (float) (-2 * unit), 0),
+            Vec3f((float) ((rows + 1) * unit), (float) (-2 * unit), 0),
+            Vec3f((float) ((rows + 1) * unit), (float) ((columns + 1) * unit), 0),
+            Vec3f((float) (-2 * unit), (float) ((columns + 1) * unit), 0)
+    };
+    Vec3d center((rows - 1) * unit / 2, (columns - 1) * unit / 2, 0);
+    double extent = (max(rows, columns) + 3) * unit;
+
+    // Draw poses until the whole board is in front of the camera and inside the image.
+    Mat rot;
+    Mat tra;
+    Matx33d R;
+    Vec3d t;
+    bool inside = false;
+    while (!inside) {
+        Vec3d angles(rng.uniform(-0.6, 0.6), rng.uniform(-0.6, 0.6), rng.uniform(-0.3, 0.3));
+        Rodrigues(angles, R);
+        double z = extent * fx / (size.width * rng.uniform(0.35, 0.7));
+        Vec3d target(
+                (rng.uniform(0.3, 0.7) * size.width - cx) / fx, (rng.uniform(0.3, 0.7) * size.height - cy) / fy, 1
+        );
+        t = target * z - R * center;
+        rot = Mat(angles).clone();
+        tra = Mat(t).clone();
+
+        vector<Vec2f> projected;
+        projectPoints(outline, rot, tra, camera_matrix, dist, projected);
+        inside = true;
+        for (int i = 0; i < outline.size(); i++) {
+            Vec3d camera_point = R * Vec3d(outline[i]) + t;
+            inside &= camera_point[2] > 0 && projected[i][0] >= 0 && projected[i][1] >= 0 &&
+                      projected[i][0] < size.width && projected[i][1] < size.height;
+        }
+    }
+
+    // Cast the ray of each sub-pixel on the board plane: with a = R^T d and b = R^T t, the point is l * a - b and
+    // its z is 0.
+    Matx33d Rt = R.t();
+    Vec3d b = Rt * t;
+    Mat fine(rays.size(), CV_8U);
+    parallel_for_(Range(0, rays.rows), [&](const Range &range) {
+        for (int y = range.start; y < range.end; y++) {
+            const Vec2f *ray = rays.ptr<Vec2f>(y);
+            uchar *out = fine.ptr<uchar>(y);
+            for (int x = 0; x < rays.cols; x++) {
+                Vec3d a = Rt * Vec3d(ray[x][0], ray[x][1], 1);
+                double l = b[2] / a[2];
+                double bx = (l * a[0] - b[0]) / unit;
+                double by = (l * a[1] - b[1]) / unit;
+                uchar value = 110;
+                if (bx >= -2 && bx < rows + 1 && by >= -2 && by < columns + 1) {
+                    value = 220;
+                    if (bx >= -1 && bx < rows && by >= -1 && by < columns)
+                        value = (((int) floor(bx) + (int) floor(by)) & 1) ? 220 : 30;
+                }
+                out[x] = value;
+            }
+        }
+    });
+
+    // Average the sub-pixels, then degrade the image like a real camera would.
+    SyntheticView view;
+    Mat image;
+    resize(fine, image, size, 0, 0, INTER_AREA);
+    if (options.blur > 0)
+        GaussianBlur(image, image, Size(), options.blur);
+    Mat noisy;
+    image.convertTo(noisy, CV_32F);
+    Mat noise(size, CV_32F);
+    rng.fill(noise, RNG::NORMAL, 0, options.noise);
+    noisy += noise;
+    noisy.convertTo(view.image, CV_8U);
+
+    vector<Vec3f> pattern = getObjectPoints(1, rows, columns, options.unit_size)[0];
+    projectPoints(pattern, rot, tra, camera_matrix, dist, view.corners);
+    return view;
+}
+
+double cornerError(const vector<Vec2f> &found, const vector<Vec2f> &truth) {
+    double forward = 0;
+    double backward = 0;
+    auto n = truth.size();
+    for (int i = 0; i < n; i++) {
+        Vec2f f = found[i] - truth[i];
+        Vec2f b = found[i] - truth[n - 1 - i];
+        forward += f.dot(f);
+        backward += b.dot(b);
+    }
+    return sqrt(min(forward, backward) / n);
+}
+
+/**
+ * @param start When the stage started.
+ * @return Seconds since then.
+ */
+static double secondsSince(const chrono::steady_clock::time_point &start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+void runBenchmark(const Size &size, const BenchOptions &options) {
+    // Ground truth: a plausible camera for the resolution, with noticeable distortion.
+    Mat camera_matrix = (Mat_<double>(3, 3) <<
+            0.8 * size.width, 0, size.width / 2.0 + 3.5,
+            0, 0.8 * size.width, size.height / 2.0 - 2.5,
+            0, 0, 1);
+    vector<double> dist = {-0.2, 0.05, 0.001, -0.0005, 0};
+    int n = options.views;
+    ThreadPool pool(options.detection.threads);
+
+    // Render.
+    auto start = chrono::steady_clock::now();
+    Mat rays = cameraRays(camera_matrix, dist, size);
+    vector<SyntheticView> views(n);
+    pool.parallelFor(n, [&](int i) {
+        RNG rng((uint64) options.seed * 1000003 + i);
+        views[i] = renderView(rays, camera_matrix, dist, size, options, rng);
+    });
+    double render_time = secondsSince(start);
+
+    // Detection and refinement, timed apart.
+    vector<vector<Vec2f>> corners(n);
+    vector<char> found(n);
+    start = chrono::steady_clock::now();
+    pool.parallelFor(n, [&](int i) {
+        found[i] = detectCorners(views[i].image, options.pattern_size, options.detection.search_size, corners[i]);
+    });
+    double detection_time = secondsSince(start);
+    start = chrono::steady_clock::now();
+    pool.parallelFor(n, [&](int i) {
+        if (found[i])
+            refineCorners(views[i].image, corners[i]);
+    });
+    double refinement_time = secondsSince(start);
+
+    vector<vector<Vec2f>> image_points;
+    vector<double> corner_errors;
+    vector<Mat> images;
+    for (int i = 0; i < n; i++) {
+        if (!found[i])
+            continue;
+        corner_errors.push_back(cornerError(corners[i], views[i].corners));
+        image_points.push_back(corners[i]);
+        images.push_back(views[i].image);
+    }
+
+    cout << size.width << "x" << size.height << ", " << image_points.size() << " of " << n
+         << " views found:" << endl;
+    if (image_points.size() < 3) {
+        cout << "\tToo few views to calibrate." << endl;
+        return;
+    }
+
+    // Calibration.
+    int m = (int) image_points.size();
+    vector<vector<Vec3f>> object_points = getObjectPoints(
+            m, options.pattern_size.height, options.pattern_size.width, options.unit_size
+    );
+    Mat estimated_matrix;
+    vector<double> estimated_dist;
+    vector<Mat> rot;
+    vector<Mat> tra;
+    start = chrono::steady_clock::now();
+    double rms = calibrateCamera(
+            object_points, image_points, size, estimated_matrix, estimated_dist, rot, tra, 0
+    );
+    double calibration_time = secondsSince(start);
+
+    // Reprojection errors, one view at a time and batched.
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < m; i++)
+        reprojectionError(object_points[i], image_points[i], rot[i], tra[i], estimated_matrix, estimated_dist);
+    double reprojection_time = secondsSince(start);
+    ReprojectionEvaluator evaluator(
+            options.pattern_size.height, options.pattern_size.width, options.unit_size, options.detection.threads
+    );
+    evaluator.evaluate(image_points, rot, tra, estimated_matrix, estimated_dist);
+    start = chrono::steady_clock::now();
+    evaluator.evaluate(image_points, rot, tra, estimated_matrix, estimated_dist);
+    double evaluator_time = secondsSince(start);
+
+    // Undistortion.
+    CalibratedCamera camera = {estimated_matrix, estimated_dist, size};
+    start = chrono::steady_clock::now();
+    prepareUndistortion(camera);
+    double maps_time = secondsSince(start);
+    Undistorter undistorter(camera, size, options.detection.threads);
+    Mat rectified;
+    start = chrono::steady_clock::now();
+    for (auto &image : images)
+        undistorter.apply(image, rectified);
+    double undistortion_time = secondsSince(start);
+
+    // Timings.
+    double megapixels = size.area() / 1e6;
+    cout << fixed << setprecision(4)
+         << "\trender\t\t" << render_time << " s\n"
+         << "\tdetection\t" << detection_time << " s\t(" << n / detection_time << " views/s)\n"
+         << "\trefinement\t" << refinement_time << " s\t(" << m / refinement_time << " views/s)\n"
+         << "\tcalibration\t" << calibration_time << " s\n"
+         << "\treprojection\t" << reprojection_time << " s\t(" << m / reprojection_time << " views/s)\n"
+         << "\tbatched\t\t" << evaluator_time << " s\t(" << m / evaluator_time << " views/s)\n"
+         << "\tmaps\t\t" << maps_time << " s\n"
+         << "\tundistortion\t" << undistortion_time << " s\t(" << m / undistortion_time << " fps, "
+         << m * megapixels / undistortion_time << " MP/s)\n";
+
+    // Errors against the truth.
+    cout << "\tcorner RMS\t" << meanRMS(corner_errors) << " px\n"
+         << "\tcalibration RMS\t" << rms << " px\n"
+         << "\tfx, fy error\t" << estimated_matrix.at<double>(0, 0) - camera_matrix.at<double>(0, 0) << ", "
+         << estimated_matrix.at<double>(1, 1) - camera_matrix.at<double>(1, 1) << " px\n"
+         << "\tcx, cy error\t" << estimated_matrix.at<double>(0, 2) - camera_matrix.at<double>(0, 2) << ", "
+         << estimated_matrix.at<double>(1, 2) - camera_matrix.at<double>(1, 2) << " px\n"
+         << "\tdistortion error\t{";
+    for (int i = 0; i < dist.size(); i++)
+        cout << (i > 0 ? ", " : "") << estimated_dist[i] - dist[i];
+    cout << "}" << endl;
+    cout.unsetf(ios::fixed);
+}
@@ -0,0 +1,506 @@
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <stdexcept>
+#include "calibration.h"
+#include "thread_pool.h"
+
+using namespace std;
+using namespace cv;
+
+vector<Mat> getCheckerboardImages(const vector<string> &files) {
+    vector<Mat> images;
+    images.reserve(files.size());
+
+    // Load images.
+    for (auto &file : files)
+        images.push_back(imread(file));
+
+    return images;
+}
+
+vector<vector<Vec2f>> getImagePoints(
+        const vector<Mat> &checkerboard_images, const Size &pattern_size, const DetectionOptions &options
+) {
+    auto N = checkerboard_images.size();
+    vector<vector<Vec2f>> image_points(N);
+    vector<char> found(N, false);
+
+    // Each image is independent.
+    ThreadPool own_pool(options.pool ? 1 : options.threads);
+    ThreadPool &pool = options.pool ? *options.pool : own_pool;
+    pool.parallelFor((int) N, [&](int i) {
+        found[i] = findCorners(checkerboard_images[i], pattern_size, options.search_size, image_points[i]);
+    });
+
+    // Raise error if no corners found.
+    for (auto f : found)
+        if (!f)
+            throw invalid_argument("Image had missing corners.");
+
+    return image_points;
+}
+
+/**
+ * @param file A file.
+ * @return A string made of the file's modification time and size, empty if the file does not exist.
+ */
+static string fileStamp(const string &file) {
+    struct stat info{};
+    if (stat(file.c_str(), &info) != 0)
+        return "";
+    return to_string((long long) info.st_mtime) + ":" + to_string((long long) info.st_size);
+}
+
+vector<ViewDetection> detectViews(
+        const vector<string> &files, const Size &pattern_size, const DetectionOptions &options, const string &cache_file
+) {
+    auto N = files.size();
+    vector<ViewDetection> views(N);
+
+    // Read the results of earlier runs, if they used the same pattern.
+    map<string, ViewDetection> cached;
+    if (!cache_file.empty() && utils::fs::exists(cache_file)) {
+        FileStorage fs(cache_file, FileStorage::READ);
+        if ((int) fs["pattern_width"] == pattern_size.width && (int) fs["pattern_height"] == pattern_size.height) {
+            FileNode nodes = fs["views"];
+            for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+                ViewDetection view;
+                view.file = (string) (*it)["file"];
+                view.stamp = (string) (*it)["stamp"];
+                view.found = (int) (*it)["found"] != 0;
+                view.seconds = (double) (*it)["seconds"];
+                (*it)["corners"] >> view.corners;
+                view.cached = true;
+                cached[view.file] = view;
+            }
+        }
+    }
+
+    // Detect the views that are new or changed.
+    ThreadPool own_pool(options.pool ? 1 : options.threads);
+    ThreadPool &pool = options.pool ? *options.pool : own_pool;
+    pool.parallelFor((int) N, [&](int i) {
+        string stamp = fileStamp(files[i]);
+        auto hit = cached.find(files[i]);
+        if (hit != cached.end() && !stamp.empty() && hit->second.stamp == stamp) {
+            views[i] = hit->second;
+            return;
+        }
+
+        auto start = chrono::steady_clock::now();
+        ViewDetection &view = views[i];
+        view.file = files[i];
+        view.stamp = stamp;
+        Mat image = imread(files[i]);
+        view.found = !image.empty() && findCorners(image, pattern_size, options.search_size, view.corners);
+        if (!view.found)
+            view.corners.clear();
+        view.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    });
+
+    // Save all results for the next run.
+    if (!cache_file.empty()) {
+        FileStorage fs(cache_file, FileStorage::WRITE);
+        fs << "pattern_width" << pattern_size.width << "pattern_height" << pattern_size.height;
+        fs << "views" << "[";
+        for (auto &view : views) {
+            fs << "{" << "file" << view.file << "stamp" << view.stamp << "found" << (int) view.found
+               << "seconds" << view.seconds << "corners" << view.corners << "}";
+        }
+        fs << "]";
+    }
+
+    return views;
+}
+
+bool findCorners(const Mat &image, const Size &pattern_size, int search_size, vector<Vec2f> &corners) {
+    Mat gray;
+    if (image.channels() == 1)
+        gray = image;
+    else
+        cvtColor(image, gray, COLOR_BGR2GRAY);
+
+    if (!detectCorners(gray, pattern_size, search_size, corners))
+        return false;
+    refineCorners(gray, corners);
+    return true;
+}
+
+bool detectCorners(const Mat &gray, const Size &pattern_size, int search_size, vector<Vec2f> &corners) {
+    // Search on a smaller image first.
+    bool res = false;
+    int longest = max(gray.cols, gray.rows);
+    if (search_size > 0 && longest > search_size) {
+        double scale = (double) search_size / longest;
+        Mat small;
+        resize(gray, small, Size(), scale, scale, INTER_AREA);
+        // Images without a pattern are discarded here, without ever being searched at full resolution.
+        if (!checkChessboard(small, pattern_size))
+            return false;
+        res = findChessboardCorners(small, pattern_size, corners, CALIB_CB_ADAPTIVE_THRESH | CALIB_CB_NORMALIZE_IMAGE);
+        // Bring the corners back to full resolution, pixel centers are at half units.
+        for (auto &corner : corners) {
+            corner[0] = (float) ((corner[0] + 0.5) / scale - 0.5);
+            corner[1] = (float) ((corner[1] + 0.5) / scale - 0.5);
+        }
+    }
+
+    // Full resolution search if the pattern seems to be there but the small image was not enough.
+    if (!res)
+        res = findChessboardCorners(gray, pattern_size, corners, 0);
+    return res;
+}
+
+void refineCorners(const Mat &gray, vector<Vec2f> &corners) {
+    // Refine to sub-pixel precision.
+    cornerSubPix(
+            gray, corners, Size(15, 15), Size(-1, -1),
+            TermCriteria(TermCriteria::EPS | TermCriteria::MAX_ITER, 30, 0.001)
+    );
+}
+
+vector<vector<Vec3f>> getObjectPoints(int n, int rows, int columns, float unit_size) {
+    vector<vector<Vec3f>> obj_points;
+
+    // Each pattern contains the same set of points, because all patterns are the same checkerboard.
+    for (int i = 0; i < n; i++) {
+        vector<Vec3f> patt;
+        for (int j = 0; j < rows; j++)
+            for (int k = 0; k < columns; k++)
+                patt.emplace_back(((float) j) * unit_size, ((float) k) * unit_size, 0);
+        obj_points.push_back(patt);
+    }
+    return obj_points;
+}
+
+double reprojectionError(
+        const vector<Vec3f> &object_points, const vector<Vec2f> &pred_image_points,
+        const Mat &rot, const Mat &tra, const Mat &camera_matrix, const vector<double> &dist
+) {
+    // Project the points and compute the distance with the predicted ones.
+    vector<Vec2f> image_points;
+    projectPoints(object_points, rot, tra, camera_matrix, dist, image_points);
+    return sqrt(norm(pred_image_points, image_points, NORM_L2SQR) / image_points.size());
+}
+
+double meanRMS(const vector<double> &single_RMS) {
+    // Accumulate the squares directly, no need for a temporary vector.
+    double sum = 0;
+    for (auto rms : single_RMS)
+        sum += rms * rms;
+    return single_RMS.empty() ? 0 : sqrt(sum / single_RMS.size());
+}
+
+ReprojectionEvaluator::ReprojectionEvaluator(int rows, int columns, float unit_size, int threads) : pool(threads) {
+    // Same points as each pattern of getObjectPoints().
+    pattern_points = getObjectPoints(1, rows, columns, unit_size)[0];
+}
+
+double ReprojectionEvaluator::evaluate(
+        const vector<vector<Vec2f>> &image_points, const vector<Mat> &rot, const vector<Mat> &tra,
+        const Mat &camera_matrix, const vector<double> &dist
+) {
+    int n = (int) image_points.size();
+    int p = (int) pattern_points.size();
+
+    // No allocation if the number of views did not grow.
+    projected.create(n, p, CV_32FC2);
+    residual_buffer.create(n, p, CV_32FC2);
+    view_rms.resize(n);
+    squared_sums.resize(n);
+
+    pool.parallelFor(n, [&](int i) {
+        CV_Assert((int) image_points[i].size() == p);
+
+        // Project straight into this view's row of the shared buffer.
+        Mat projected_row = projected.row(i);
+        projectPoints(pattern_points, rot[i], tra[i], camera_matrix, dist, projected_row);
+
+        const Vec2f *proj = projected.ptr<Vec2f>(i);
+        Vec2f *residual = residual_buffer.ptr<Vec2f>(i);
+        double sum = 0;
+        for (int j = 0; j < p; j++) {
+            residual[j] = image_points[i][j] - proj[j];
+            sum += residual[j].dot(residual[j]);
+        }
+        squared_sums[i] = sum;
+        view_rms[i] = sqrt(sum / p);
+    });
+
+    double total = 0;
+    for (auto sum : squared_sums)
+        total += sum;
+    return (n > 0) ? sqrt(total / ((double) n * p)) : 0;
+}
+
+const vector<double> &ReprojectionEvaluator::viewRMS() const {
+    return view_rms;
+}
+
+const Mat &ReprojectionEvaluator::residuals() const {
+    return residual_buffer;
+}
+
+const vector<Vec3f> &ReprojectionEvaluator::pattern() const {
+    return pattern_points;
+}
+
+// Cells per side of the grid used to measure how much of the image the views cover.
+static const int COVERAGE_GRID = 8;
+
+/**
+ * Describe the pose of a view with quantities that do not need a calibration: where the pattern is, how big it
+ * appears (i.e. how close it is) and how much it is tilted, from the ratio of the opposite sides of its outer corners.
+ */
+static Vec<double, 5> viewFeatures(const vector<Vec2f> &corners, const Size &pattern_size, const Size &image_size) {
+    int w = pattern_size.width;
+    int h = pattern_size.height;
+    Point2f top_left = corners[0];
+    Point2f top_right = corners[w - 1];
+    Point2f bottom_left = corners[(h - 1) * w];
+    Point2f bottom_right = corners[h * w - 1];
+
+    vector<Point2f> quad = {top_left, top_right, bottom_right, bottom_left};
+    Point2f center = (top_left + top_right + bottom_left + bottom_right) / 4;
+    double scale = sqrt(contourArea(quad) / image_size.area());
+    double tilt_x = log((norm(top_right - bottom_right) + 1) / (norm(top_left - bottom_left) + 1));
+    double tilt_y = log((norm(bottom_left - bottom_right) + 1) / (norm(top_left - top_right) + 1));
+
+    return Vec<double, 5>(center.x / image_size.width, center.y / image_size.height, scale, tilt_x, tilt_y);
+}
+
+vector<int> selectViews(
+        const vector<vector<Vec2f>> &image_points, const Size &pattern_size, const Size &image_size, int max_views
+) {
+    int n = (int) image_points.size();
+    if (max_views <= 0 || max_views >= n) {
+        vector<int> all(n);
+        for (int i = 0; i < n; i++)
+            all[i] = i;
+        return all;
+    }
+
+    // Pose features and covered cells of each view.
+    vector<Vec<double, 5>> features(n);
+    vector<vector<int>> cells(n);
+    for (int i = 0; i < n; i++) {
+        features[i] = viewFeatures(image_points[i], pattern_size, image_size);
+        for (auto &corner : image_points[i]) {
+            int cx = min(max((int) (corner[0] * COVERAGE_GRID / image_size.width), 0), COVERAGE_GRID - 1);
+            int cy = min(max((int) (corner[1] * COVERAGE_GRID / image_size.height), 0), COVERAGE_GRID - 1);
+            cells[i].push_back(cy * COVERAGE_GRID + cx);
+        }
+        sort(cells[i].begin(), cells[i].end());
+        cells[i].erase(unique(cells[i].begin(), cells[i].end()), cells[i].end());
+    }
+
+    // Greedily add the view that covers the most new cells and is farthest from the poses already chosen.
+    vector<bool> covered(COVERAGE_GRID * COVERAGE_GRID, false);
+    vector<double> distance(n, numeric_limits<double>::max());
+    vector<bool> taken(n, false);
+    vector<int> selected;
+    selected.reserve(max_views);
+    while ((int) selected.size() < max_views) {
+        int best = -1;
+        double best_score = -1;
+        for (int i = 0; i < n; i++) {
+            if (taken[i])
+                continue;
+            int gain = 0;
+            for (int cell : cells[i])
+                gain += !covered[cell];
+            // The first view has no neighbours, pick it by coverage only.
+            double spread = selected.empty() ? 0 : sqrt(distance[i]);
+            double score = (double) gain / covered.size() + spread;
+            if (score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+
+        taken[best] = true;
+        selected.push_back(best);
+        for (int cell : cells[best])
+            covered[cell] = true;
+        for (int i = 0; i < n; i++) {
+            Vec<double, 5> difference = features[i] - features[best];
+            distance[i] = min(distance[i], difference.dot(difference));
+        }
+    }
+
+    sort(selected.begin(), selected.end());
+    return selected;
+}
+
+void undistortionMaps(const CalibratedCamera &camera, const Size &size, Mat &map1, Mat &map2, Rect *roi) {
+    // Get camera matrix for target image.
+    Rect valid_roi;
+    Mat new_camera_matrix = getOptimalNewCameraMatrix(
+            camera.camera_matrix, camera.distortion_coefficients, size, 1, size, &valid_roi
+    );
+    // Degenerate distortion can leave no valid region, in which case the image is not cropped.
+    if (valid_roi.empty())
+        valid_roi = Rect(Point(), size);
+    if (roi)
+        *roi = valid_roi;
+
+    // Cropping to the valid region and resizing it back to the full size is just another pinhole camera: scale the
+    // focal lengths and move the principal point, keeping pixel centers aligned as resize() does.
+    double scale_x = (double) valid_roi.width / size.width;
+    double scale_y = (double) valid_roi.height / size.height;
+    new_camera_matrix.at<double>(0, 0) /= scale_x;
+    new_camera_matrix.at<double>(1, 1) /= scale_y;
+    new_camera_matrix.at<double>(0, 2) = (new_camera_matrix.at<double>(0, 2) - valid_roi.x + 0.5) / scale_x - 0.5;
+    new_camera_matrix.at<double>(1, 2) = (new_camera_matrix.at<double>(1, 2) - valid_roi.y + 0.5) / scale_y - 0.5;
+
+    // Get maps from new camera matrix. The fixed point form is smaller and faster to remap with.
+    initUndistortRectifyMap(
+            camera.camera_matrix, camera.distortion_coefficients, Mat(),
+            new_camera_matrix, size, CV_16SC2, map1, map2
+    );
+}
+
+void prepareUndistortion(CalibratedCamera &camera) {
+    undistortionMaps(camera, camera.image_size, camera.map1, camera.map2, &camera.roi);
+}
+
+void setCalibrationViews(CalibratedCamera &camera, const vector<vector<Vec2f>> &image_points) {
+    int n = (int) image_points.size();
+    int p = n > 0 ? (int) image_points[0].size() : 0;
+    camera.view_corners.create(n, p, CV_32FC2);
+    for (int i = 0; i < n; i++) {
+        Mat(1, p, CV_32FC2, (void *) image_points[i].data()).copyTo(camera.view_corners.row(i));
+    }
+}
+
+RecalibrationReport recalibrate(
+        CalibratedCamera &camera, const vector<vector<Vec2f>> &new_views,
+        const Size &pattern_size, float unit_size, int max_iterations
+) {
+    auto start = chrono::steady_clock::now();
+
+    // Old views first, then the new ones.
+    vector<vector<Vec2f>> image_points;
+    image_points.reserve(camera.view_corners.rows + new_views.size());
+    for (int i = 0; i < camera.view_corners.rows; i++) {
+        const Vec2f *row = camera.view_corners.ptr<Vec2f>(i);
+        image_points.emplace_back(row, row + camera.view_corners.cols);
+    }
+    image_points.insert(image_points.end(), new_views.begin(), new_views.end());
+    vector<vector<Vec3f>> object_points = getObjectPoints(
+            (int) image_points.size(), pattern_size.height, pattern_size.width, unit_size
+    );
+
+    // Start from the current intrinsics, which should already be close.
+    Mat camera_matrix = camera.camera_matrix.clone();
+    vector<double> dist = camera.distortion_coefficients;
+    vector<Mat> rot;
+    vector<Mat> tra;
+    RecalibrationReport report;
+    report.views = (int) image_points.size();
+    report.rms = calibrateCamera(
+            object_points, image_points, camera.image_size, camera_matrix, dist, rot, tra,
+            CALIB_USE_INTRINSIC_GUESS,
+            TermCriteria(TermCriteria::COUNT | TermCriteria::EPS, max_iterations, DBL_EPSILON)
+    );
+
+    // How much the parameters moved.
+    report.intrinsics_delta = Vec4d(
+            camera_matrix.at<double>(0, 0) - camera.camera_matrix.at<double>(0, 0),
+            camera_matrix.at<double>(1, 1) - camera.camera_matrix.at<double>(1, 1),
+            camera_matrix.at<double>(0, 2) - camera.camera_matrix.at<double>(0, 2),
+            camera_matrix.at<double>(1, 2) - camera.camera_matrix.at<double>(1, 2)
+    );
+    dist.resize(max(dist.size(), camera.distortion_coefficients.size()), 0);
+    camera.distortion_coefficients.resize(dist.size(), 0);
+    report.distortion_delta = norm(dist, camera.distortion_coefficients);
+
+    camera.camera_matrix = camera_matrix;
+    camera.distortion_coefficients = dist;
+    setCalibrationViews(camera, image_points);
+    if (!camera.map1.empty())
+        prepareUndistortion(camera);
+
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+void saveCamera(const CalibratedCamera &camera, const string &file) {
+    // Base64 keeps the maps reasonably small and quick to parse.
+    FileStorage fs(file, FileStorage::WRITE | FileStorage::BASE64);
+    fs << "camera_matrix" << camera.camera_matrix;
+    fs << "distortion_coefficients" << camera.distortion_coefficients;
+    fs << "image_size" << camera.image_size;
+    fs << "roi" << camera.roi;
+    fs << "map1" << camera.map1;
+    fs << "map2" << camera.map2;
+    fs << "view_corners" << camera.view_corners;
+}
+
+bool loadCamera(const string &file, CalibratedCamera &camera) {
+    if (!utils::fs::exists(file))
+        return false;
+
+    FileStorage fs(file, FileStorage::READ);
+    fs["camera_matrix"] >> camera.camera_matrix;
+    fs["distortion_coefficients"] >> camera.distortion_coefficients;
+    fs["image_size"] >> camera.image_size;
+    fs["roi"] >> camera.roi;
+    fs["map1"] >> camera.map1;
+    fs["map2"] >> camera.map2;
+    fs["view_corners"] >> camera.view_corners;
+    return true;
+}
+
+Mat undistortImage(const CalibratedCamera &camera, const Mat &image) {
+    Size original_size = Size(image.cols, image.rows);
+
+    // Only build the maps if there are none for this size.
+    Mat map1 = camera.map1, map2 = camera.map2;
+    if (map1.empty() || camera.image_size != original_size)
+        undistortionMaps(camera, original_size, map1, map2);
+
+    // The maps already crop and resize, a single pass is enough.
+    Mat rectified;
+    remap(image, rectified, map1, map2, INTER_LINEAR);
+
+    return rectified;
+}
+
+Undistorter::Undistorter(const CalibratedCamera &camera, const Size &size, int threads) : pool(threads) {
+    image_size = size;
+    if (!camera.map1.empty() && camera.image_size == size) {
+        map1 = camera.map1;
+        map2 = camera.map2;
+    } else {
+        undistortionMaps(camera, size, map1, map2);
+    }
+}
+
+void Undistorter::apply(const Mat &image, Mat &output) {
+    CV_Assert(image.size() == image_size);
+    output.create(image_size, image.type());
+
+    // Bands of rows are independent, each one only needs its own rows of the maps.
+    int bands = pool.size() * 4;
+    int band_rows = (image_size.height + bands - 1) / bands;
+    pool.parallelFor(bands, [&](int b) {
+        Range rows(min(b * band_rows, image_size.height), min((b + 1) * band_rows, image_size.height));
+        if (rows.empty())
+            return;
+        Mat band = output.rowRange(rows);
+        remap(image, band, map1.rowRange(rows), map2.rowRange(rows), INTER_LINEAR);
+    });
+}
+
+Size Undistorter::size() const {
+    return image_size;
+}
\ No newline at end of file
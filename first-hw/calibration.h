@@ -0,0 +1,352 @@
+#ifndef LAB2_CALIBRATION_H
+#define LAB2_CALIBRATION_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "thread_pool.h"
+
+// Just a structure to keep information about a camera in one place.
+struct CalibratedCamera {
+    // Intrinsics matrix.
+    cv::Mat camera_matrix;
+    // Distortion coefficients.
+    std::vector<double> distortion_coefficients;
+    // Size of the calibration images.
+    cv::Size image_size;
+    // Undistortion maps for image_size in fixed point form (CV_16SC2 coordinates, CV_16UC1 interpolation table), and
+    // the region of the undistorted image with valid pixels. The maps already crop that region and resize it to
+    // image_size. Empty until prepareUndistortion() is called.
+    cv::Mat map1;
+    cv::Mat map2;
+    cv::Rect roi;
+    // Corners of the views used for the calibration, one row per view (CV_32FC2). Kept to refine the calibration later.
+    cv::Mat view_corners;
+};
+
+// Outcome of the refinement of a calibration with new views.
+struct RecalibrationReport {
+    // Views used, old and new.
+    int views = 0;
+    // RMS reprojection error after the refinement.
+    double rms = 0;
+    // Change of fx, fy, cx and cy.
+    cv::Vec4d intrinsics_delta;
+    // Norm of the change of the distortion coefficients.
+    double distortion_delta = 0;
+    // Wall time of the refinement.
+    double seconds = 0;
+};
+
+// Options for the detection of the checkerboard corners.
+struct DetectionOptions {
+    // The pattern is first searched on a copy of the image whose longest side is this long. 0 or less searches at
+    // full resolution only.
+    int search_size = 1024;
+    // Threads used to process the images. 0 uses all cores.
+    int threads = 0;
+    // Pool to run on instead of creating one with the above threads, to share a thread budget with other work.
+    ThreadPool *pool = nullptr;
+};
+
+// Outcome of the corner detection on a single view.
+struct ViewDetection {
+    // Image file and its modification time and size, used to tell whether it changed.
+    std::string file;
+    std::string stamp;
+    // Frame of the video the view comes from, -1 if the file is an image.
+    int frame = -1;
+    // Whether the pattern was found, and its corners if so.
+    bool found = false;
+    std::vector<cv::Vec2f> corners;
+    // Seconds spent loading the image and finding the corners.
+    double seconds = 0;
+    // True if the result was reused from an earlier run.
+    bool cached = false;
+    // True if the corners were tracked from the previous view instead of detected.
+    bool tracked = false;
+};
+
+/**
+ * @param files The set of filenames for the images.
+ * @return A vector containing the images.
+ */
+std::vector<cv::Mat> getCheckerboardImages(const std::vector<std::string> &files);
+
+/**
+ * Images are processed in parallel. The pattern is searched on a downscaled image first, and at full resolution only if
+ * it is not found there. Corners are always refined on the full resolution image.
+ *
+ * @param checkerboard_images The images in which to find corners.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param options How to search for the corners.
+ * @return A vector with the coordinates of the corners on the images.
+ * @throws invalid_argument if an image has missing corners.
+ */
+std::vector<std::vector<cv::Vec2f>> getImagePoints(
+        const std::vector<cv::Mat> &checkerboard_images, const cv::Size &pattern_size,
+        const DetectionOptions &options = DetectionOptions()
+);
+
+/**
+ * Like getImagePoints(), but views where the pattern is not found (or that cannot be read) are reported instead of
+ * aborting the detection. Images are loaded by the detection threads, one at a time.
+ *
+ * @param files The image files.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param options How to search for the corners.
+ * @param cache_file If not empty, results of earlier runs are read from this file and reused for the images that did
+ *        not change since, then all results are written back to it.
+ * @return The outcome for each file, in the same order.
+ */
+std::vector<ViewDetection> detectViews(
+        const std::vector<std::string> &files, const cv::Size &pattern_size,
+        const DetectionOptions &options = DetectionOptions(), const std::string &cache_file = ""
+);
+
+/**
+ * Find the corners of the checkerboard on a single image.
+ *
+ * @param image The image in which to find corners.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param search_size Longest side of the image on which the pattern is searched first. 0 or less for full resolution.
+ * @param corners Destination for the refined corners.
+ * @return false if the pattern was not found.
+ */
+bool findCorners(const cv::Mat &image, const cv::Size &pattern_size, int search_size, std::vector<cv::Vec2f> &corners);
+
+/**
+ * The search step of findCorners(), without the sub-pixel refinement.
+ *
+ * @param gray The grayscale image in which to find corners.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param search_size Longest side of the image on which the pattern is searched first. Images rejected there by a
+ * quick check are not searched at full resolution. 0 or less for full resolution.
+ * @param corners Destination for the corners.
+ * @return false if the pattern was not found.
+ */
+bool detectCorners(const cv::Mat &gray, const cv::Size &pattern_size, int search_size, std::vector<cv::Vec2f> &corners);
+
+/**
+ * The refinement step of findCorners(): move the corners to sub-pixel precision on the full resolution image.
+ *
+ * @param gray The grayscale image.
+ * @param corners The corners, refined in place.
+ */
+void refineCorners(const cv::Mat &gray, std::vector<cv::Vec2f> &corners);
+
+/**
+ * @param n How many patterns are needed.
+ * @param rows How many rows each pattern has.
+ * @param columns How many columns each pattern has.
+ * @param unit_size The size, in meters, of each square of the checkerboard.
+ * @return A Vector of object points, essentially a vector of n identical vectors, each containing the same
+ *         rows * columns points.
+ */
+std::vector<std::vector<cv::Vec3f>> getObjectPoints(int n, int rows, int columns, float unit_size);
+
+/**
+ * Compute the reprojection error for an image.
+ *
+ * @param object_points The object points in the world reference frame.
+ * @param pred_image_points The points found in the image.
+ * @param rot The rotation vector between world frame and camera frame.
+ * @param tra The translation vector between world frame and camera frame.
+ * @param camera_matrix The 3 by 3 camera matrix for intrinsic params.
+ * @param dist The distortion coefficients vectors.
+ * @return The reprojection error for the given object.
+ */
+double reprojectionError(
+        const std::vector<cv::Vec3f> &object_points, const std::vector<cv::Vec2f> &pred_image_points,
+        const cv::Mat &rot, const cv::Mat &tra, const cv::Mat &camera_matrix, const std::vector<double> &dist
+);
+
+/**
+ * Compute the mean RMS for a set of images.
+ *
+ * @param single_RMS The RMS for single images.
+ */
+double meanRMS(const std::vector<double> &single_RMS);
+
+/**
+ * Computes the reprojection errors of many views of the same planar pattern at once. The pattern is kept once, and all
+ * views are projected in parallel into a single buffer that is reused by later calls, so repeated evaluations (e.g.
+ * while pruning views) do not allocate.
+ */
+class ReprojectionEvaluator {
+
+public:
+
+    /**
+     * @param rows How many rows the pattern has.
+     * @param columns How many columns the pattern has.
+     * @param unit_size The size, in meters, of each square of the checkerboard.
+     * @param threads Threads used to project the views. 0 uses all cores.
+     */
+    ReprojectionEvaluator(int rows, int columns, float unit_size, int threads = 0);
+
+    /**
+     * @param image_points The corners found on each view.
+     * @param rot The rotation vector of each view.
+     * @param tra The translation vector of each view.
+     * @param camera_matrix The 3 by 3 camera matrix for intrinsic params.
+     * @param dist The distortion coefficients vectors.
+     * @return The RMS over all corners of all views.
+     */
+    double evaluate(
+            const std::vector<std::vector<cv::Vec2f>> &image_points,
+            const std::vector<cv::Mat> &rot, const std::vector<cv::Mat> &tra,
+            const cv::Mat &camera_matrix, const std::vector<double> &dist
+    );
+
+    /**
+     * @return The RMS of each view in the last evaluation.
+     */
+    const std::vector<double> &viewRMS() const;
+
+    /**
+     * @return The residuals (found minus projected) of the last evaluation, one row per view, one CV_32FC2 element
+     *         per corner.
+     */
+    const cv::Mat &residuals() const;
+
+    /**
+     * @return The object points of the pattern.
+     */
+    const std::vector<cv::Vec3f> &pattern() const;
+
+protected:
+
+    std::vector<cv::Vec3f> pattern_points;
+    cv::Mat projected;
+    cv::Mat residual_buffer;
+    std::vector<double> view_rms;
+    std::vector<double> squared_sums;
+    ThreadPool pool;
+
+};
+
+/**
+ * Choose a small subset of views that still covers the poses of the pattern: its position and apparent size in the
+ * image, its tilt, and the area of the image reached by its corners. Views are added greedily, each time taking the one
+ * that covers the most new image area and is farthest from the poses already chosen. Calibrating on the subset costs
+ * much less than on every view, while the dropped views mostly repeat poses already chosen.
+ *
+ * @param image_points The corners found on each view.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param image_size The size of the images.
+ * @param max_views How many views to keep. 0 or more than the views keeps them all.
+ * @return The indices of the chosen views, in increasing order.
+ */
+std::vector<int> selectViews(
+        const std::vector<std::vector<cv::Vec2f>> &image_points, const cv::Size &pattern_size,
+        const cv::Size &image_size, int max_views
+);
+
+/**
+ * Compute undistortion maps that also crop the valid region and resize it back to the full size, so a single remap
+ * gives the final image.
+ *
+ * @param camera The camera.
+ * @param size Size of the images to rectify.
+ * @param map1 Destination for the fixed point coordinates (CV_16SC2).
+ * @param map2 Destination for the interpolation table (CV_16UC1).
+ * @param roi If not null, destination for the valid region of the undistorted, uncropped image. The whole image if
+ * there is no valid region, which is then not cropped.
+ */
+void undistortionMaps(
+        const CalibratedCamera &camera, const cv::Size &size, cv::Mat &map1, cv::Mat &map2, cv::Rect *roi = nullptr
+);
+
+/**
+ * Compute the undistortion maps of a camera for its image size.
+ *
+ * @param camera The camera. Its maps and valid region are replaced.
+ */
+void prepareUndistortion(CalibratedCamera &camera);
+
+/**
+ * Store in the camera the views it was calibrated on, so it can be refined later (see recalibrate).
+ *
+ * @param camera The camera.
+ * @param image_points The corners found on each view.
+ */
+void setCalibrationViews(CalibratedCamera &camera, const std::vector<std::vector<cv::Vec2f>> &image_points);
+
+/**
+ * Refine a calibration with new views, instead of solving it again from scratch. The optimization starts from the
+ * current intrinsics and stops after few iterations, since the new views usually move the parameters only slightly.
+ * The stored views are used too, so the refinement does not overfit the new ones. Undistortion maps, if prepared, are
+ * computed again.
+ *
+ * @param camera The camera, with the views it was calibrated on (see setCalibrationViews). Updated in place.
+ * @param new_views The corners found on the new views.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param unit_size The size, in meters, of each square of the checkerboard.
+ * @param max_iterations Iterations of the optimization.
+ * @return The error and how much the parameters changed.
+ */
+RecalibrationReport recalibrate(
+        CalibratedCamera &camera, const std::vector<std::vector<cv::Vec2f>> &new_views,
+        const cv::Size &pattern_size, float unit_size, int max_iterations = 10
+);
+
+/**
+ * Save a camera, with its undistortion maps if prepared.
+ *
+ * @param camera The camera to save.
+ * @param file Destination file. Must have an extension supported by cv::FileStorage.
+ */
+void saveCamera(const CalibratedCamera &camera, const std::string &file);
+
+/**
+ * @param file File written by saveCamera().
+ * @param camera Destination for the camera.
+ * @return false if the file does not exist.
+ */
+bool loadCamera(const std::string &file, CalibratedCamera &camera);
+
+/**
+ * Maps prepared for the image's size are used as they are, otherwise they are computed for this call.
+ *
+ * @param camera The camera information (intrinsics and distortion coefficients).
+ * @param image The image to rectify.
+ * @return An image obtained rectifying the input one with the parameters of the given camera.
+ */
+cv::Mat undistortImage(const CalibratedCamera &camera, const cv::Mat &image);
+
+/**
+ * Rectifies images of a fixed size, reusing the maps. Bands of rows are remapped in parallel.
+ */
+class Undistorter {
+
+public:
+
+    /**
+     * @param camera The camera. Its maps are used if prepared for this size, otherwise they are computed once here.
+     * @param size Size of the images to rectify.
+     * @param threads Threads used to remap. 0 uses all cores.
+     */
+    Undistorter(const CalibratedCamera &camera, const cv::Size &size, int threads = 0);
+
+    /**
+     * @param image The image to rectify. Must have the size given to the constructor.
+     * @param output Destination for the rectified image. Reused if it already has the right size and type.
+     */
+    void apply(const cv::Mat &image, cv::Mat &output);
+
+    /**
+     * @return The size of the images this undistorter works with.
+     */
+    cv::Size size() const;
+
+protected:
+
+    cv::Size image_size;
+    cv::Mat map1;
+    cv::Mat map2;
+    ThreadPool pool;
+
+};
+
+#endif
@@ -0,0 +1,125 @@
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <opencv2/videoio.hpp>
+#include <chrono>
+#include <stdexcept>
+#include "corner_tracker.h"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Track points between two frames, checking each of them by tracking it back.
+ *
+ * @param previous Pyramid of the previous frame.
+ * @param next Pyramid of the next frame.
+ * @param image_size The size of the frames.
+ * @param points The points on the previous frame.
+ * @param tracked Where the points are on the next frame.
+ * @param options The tracking options.
+ * @return false if any point was lost or moved back too far from where it started.
+ */
+static bool trackPoints(
+        const vector<Mat> &previous, const vector<Mat> &next, const Size &image_size,
+        const vector<Point2f> &points, vector<Point2f> &tracked, const TrackingOptions &options
+) {
+    Size window(options.window_size, options.window_size);
+    vector<uchar> status;
+    vector<float> error;
+    calcOpticalFlowPyrLK(previous, next, points, tracked, status, error, window, options.pyramid_levels);
+    for (int i = 0; i < points.size(); i++) {
+        if (!status[i] || tracked[i].x < 0 || tracked[i].y < 0 ||
+            tracked[i].x > image_size.width - 1 || tracked[i].y > image_size.height - 1)
+            return false;
+    }
+
+    // A checkerboard is full of similar corners, so the forward-backward check catches the ones that jumped to a
+    // neighbour.
+    vector<Point2f> back = points;
+    calcOpticalFlowPyrLK(
+            next, previous, tracked, back, status, error, window, options.pyramid_levels,
+            TermCriteria(TermCriteria::COUNT | TermCriteria::EPS, 30, 0.01), OPTFLOW_USE_INITIAL_FLOW
+    );
+    for (int i = 0; i < points.size(); i++) {
+        if (!status[i] || norm(back[i] - points[i]) > options.max_tracking_error)
+            return false;
+    }
+    return true;
+}
+
+vector<ViewDetection> trackVideoViews(
+        const string &video, const Size &pattern_size,
+        const DetectionOptions &detection, const TrackingOptions &tracking
+) {
+    VideoCapture capture(video);
+    if (!capture.isOpened())
+        throw invalid_argument("Cannot open video " + video + ".");
+
+    Size window(tracking.window_size, tracking.window_size);
+    int step = max(tracking.frame_step, 1);
+    vector<ViewDetection> views;
+    Mat frame;
+    Mat gray;
+    vector<Mat> pyramid;
+    vector<Mat> previous_pyramid;
+    vector<Point2f> corners;
+    vector<Point2f> previous_corners;
+    bool previous_found = false;
+    int since_keyframe = 0;
+
+    for (int index = 0; capture.read(frame); index += step) {
+        auto start = chrono::steady_clock::now();
+        ViewDetection view;
+        view.file = video;
+        view.frame = index;
+
+        if (frame.channels() == 1)
+            gray = frame;
+        else
+            cvtColor(frame, gray, COLOR_BGR2GRAY);
+        buildOpticalFlowPyramid(gray, pyramid, window, tracking.pyramid_levels);
+
+        // Follow the corners of the previous view while it can be trusted.
+        if (previous_found && since_keyframe < tracking.keyframe_interval)
+            view.tracked = trackPoints(previous_pyramid, pyramid, gray.size(), previous_corners, corners, tracking);
+
+        if (view.tracked) {
+            // Tracked corners are already close, a small window is enough.
+            cornerSubPix(
+                    gray, corners, Size(5, 5), Size(-1, -1),
+                    TermCriteria(TermCriteria::EPS | TermCriteria::MAX_ITER, 10, 0.01)
+            );
+            view.found = true;
+            since_keyframe++;
+        } else {
+            vector<Vec2f> found_corners;
+            view.found = findCorners(gray, pattern_size, detection.search_size, found_corners);
+            corners.assign(found_corners.begin(), found_corners.end());
+            since_keyframe = 0;
+        }
+        if (view.found)
+            view.corners.assign(corners.begin(), corners.end());
+
+        previous_found = view.found;
+        swap(previous_corners, corners);
+        swap(previous_pyramid, pyramid);
+        view.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        views.push_back(std::move(view));
+
+        // Skip the frames in between without decoding them.
+        for (int i = 1; i < step; i++) {
+            if (!capture.grab())
+                break;
+        }
+    }
+
+    return views;
+}
+
+Mat readFrame(const string &video, int frame) {
+    Mat image;
+    VideoCapture capture(video);
+    if (capture.isOpened() && capture.set(CAP_PROP_POS_FRAMES, frame))
+        capture.read(image);
+    return image;
+}
@@ -0,0 +1,46 @@
+#ifndef LAB2_CORNER_TRACKER_H
+#define LAB2_CORNER_TRACKER_H
+
+#include <string>
+#include <vector>
+#include "calibration.h"
+
+// Options for finding the checkerboard on the frames of a video.
+struct TrackingOptions {
+    // Only one frame every this many becomes a view, the others are skipped without being decoded.
+    int frame_step = 5;
+    // Full detection is run at least once every this many views, even if tracking is going well.
+    int keyframe_interval = 30;
+    // Largest distance, in pixels, between a corner and the point found tracking it forward and then back. If any
+    // corner goes over it the tracking is deemed lost and the pattern is detected again.
+    float max_tracking_error = 1.0f;
+    // Window and pyramid levels of the Lucas-Kanade tracker.
+    int window_size = 21;
+    int pyramid_levels = 3;
+};
+
+/**
+ * Find the checkerboard on a video. Full detection (see findCorners) only runs on keyframes: the first frame, when
+ * tracking is lost, and every keyframe_interval views. In between, the corners of the previous view are tracked with
+ * pyramidal Lucas-Kanade optical flow, checked forward and backward, and refined with cornerSubPix.
+ *
+ * @param video The video file.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param detection How to search for the corners on keyframes.
+ * @param tracking How to pick and track the frames.
+ * @return One view per picked frame, with file set to the video and frame to its index.
+ * @throws invalid_argument if the video cannot be opened.
+ */
+std::vector<ViewDetection> trackVideoViews(
+        const std::string &video, const cv::Size &pattern_size,
+        const DetectionOptions &detection, const TrackingOptions &tracking
+);
+
+/**
+ * @param video The video file.
+ * @param frame The index of the frame.
+ * @return The frame, empty if it cannot be read.
+ */
+cv::Mat readFrame(const std::string &video, int frame);
+
+#endif
@@ -1,7 +1,56 @@
 #include <opencv2/core.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#include <typeinfo>
+#include <vector>
 #include "filter.h"
 
+/**
+ * 64 bit hash of the pixels of an image, 8 bytes at a time. Not meant to resist crafted collisions.
+ */
+static uint64_t hashPixels(const cv::Mat &image) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t word) {
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    };
+    size_t row_bytes = image.cols * image.elemSize();
+    for (int y = 0; y < image.rows; y++) {
+        const uchar *row = image.ptr(y);
+        size_t x = 0;
+        for (; x + 8 <= row_bytes; x += 8) {
+            uint64_t word;
+            std::memcpy(&word, row + x, 8);
+            mix(word);
+        }
+        for (; x < row_bytes; x++)
+            mix(row[x]);
+    }
+    return hash;
+}
+
+// Filter Scratch ---
+FilterScratch::Lease::Lease(FilterScratch &scratch, size_t count) :
+        lock(scratch.mutex, std::try_to_lock), buffers(lock.owns_lock() ? &scratch.buffers : &local) {
+    if (buffers->size() < count)
+        buffers->resize(count);
+}
+
+cv::Mat &FilterScratch::Lease::operator[](size_t i) {
+    return (*buffers)[i];
+}
+
+void FilterScratch::release() {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers.clear();
+}
+
 
 /**
  * @param size Size will be force to be odd.
@@ -13,8 +62,15 @@ Filter::Filter(int size) {
 }
 
 // for base class do nothing (in derived classes it performs the corresponding filter)
-void Filter::apply(cv::Mat &image, cv::Mat &output) {
-    output = image.clone();
+void Filter::apply(cv::InputArray image, cv::OutputArray output) {
+    image.copyTo(output);
+}
+
+cv::Mat Filter::unaliased(const cv::Mat &image, cv::OutputArray output, cv::Mat &buffer) {
+    if (image.empty() || output.kind() != cv::_InputArray::MAT || output.getMat().data != image.data)
+        return image;
+    image.copyTo(buffer);
+    return buffer;
 }
 
 /**
@@ -31,6 +87,23 @@ int Filter::getSize() {
     return filter_size;
 }
 
+int Filter::getRadius() {
+    return filter_size / 2;
+}
+
+void Filter::rescale(double factor) {
+    setSize(std::max(1, (int) std::lround(filter_size * factor)));
+}
+
+void Filter::releaseScratch() {
+    scratch.release();
+}
+
+std::string Filter::cacheKey() {
+    // Subclasses that do not override this must not share the outputs of one another.
+    return std::string(typeid(*this).name()) + " " + std::to_string(filter_size);
+}
+
 
 // Write your code to implement the Gaussian, median and bilateral filters
 
@@ -43,16 +116,323 @@ void GaussianFilter::setSigma(double new_sigma) {
     this->sigma = new_sigma;
 }
 
-void GaussianFilter::apply(cv::Mat &image, cv::Mat &output) {
-    cv::GaussianBlur(image, output, cv::Size(filter_size, filter_size), sigma, sigma);
+void GaussianFilter::setMode(int new_mode) {
+    mode = new_mode;
+}
+
+// Coefficients of the Young - van Vliet recursive gaussian, normalized by b0.
+struct RecursiveGaussian {
+    float gain;
+    float c1;
+    float c2;
+    float c3;
+
+    explicit RecursiveGaussian(double sigma) {
+        double q = (sigma >= 2.5) ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * std::sqrt(1 - 0.26891 * sigma);
+        double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+        double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+        double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+        double b3 = 0.422205 * q * q * q;
+        gain = (float) (1 - (b1 + b2 + b3) / b0);
+        c1 = (float) (b1 / b0);
+        c2 = (float) (b2 / b0);
+        c3 = (float) (b3 / b0);
+    }
+};
+
+/**
+ * out = gain * in + c1 * p1 + c2 * p2 + c3 * p3 on n floats. out may be in.
+ */
+static inline void recursiveStep(
+        float *out, const float *in, const float *p1, const float *p2, const float *p3, int n,
+        const RecursiveGaussian &k
+) {
+    int i = 0;
+#if CV_SIMD128
+    cv::v_float32x4 gain = cv::v_setall_f32(k.gain);
+    cv::v_float32x4 c1 = cv::v_setall_f32(k.c1);
+    cv::v_float32x4 c2 = cv::v_setall_f32(k.c2);
+    cv::v_float32x4 c3 = cv::v_setall_f32(k.c3);
+    for (; i <= n - 4; i += 4) {
+        cv::v_float32x4 sum = cv::v_load(in + i) * gain;
+        sum = cv::v_muladd(cv::v_load(p1 + i), c1, sum);
+        sum = cv::v_muladd(cv::v_load(p2 + i), c2, sum);
+        sum = cv::v_muladd(cv::v_load(p3 + i), c3, sum);
+        cv::v_store(out + i, sum);
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = k.gain * in[i] + k.c1 * p1[i] + k.c2 * p2[i] + k.c3 * p3[i];
+}
+
+/**
+ * Blur the columns of a single channel float image in place, each row being a vector of independent columns. Borders
+ * are replicated: the filter starts as if it had seen the first (last) row forever.
+ */
+static void recursiveColumns(cv::Mat &m, const RecursiveGaussian &k) {
+    const int STRIPE = 256;
+    int height = m.rows;
+    int stripes = (m.cols + STRIPE - 1) / STRIPE;
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &range) {
+        std::vector<float> edge(STRIPE);
+        for (int s = range.start; s < range.end; s++) {
+            int x0 = s * STRIPE;
+            int n = std::min(STRIPE, m.cols - x0);
+            auto row = [&](int y) { return m.ptr<float>(y) + x0; };
+
+            // Causal pass, top to bottom.
+            std::copy(row(0), row(0) + n, edge.data());
+            for (int y = 0; y < height; y++) {
+                recursiveStep(
+                        row(y), row(y), y >= 1 ? row(y - 1) : edge.data(), y >= 2 ? row(y - 2) : edge.data(),
+                        y >= 3 ? row(y - 3) : edge.data(), n, k
+                );
+            }
+
+            // Anti-causal pass, bottom to top.
+            std::copy(row(height - 1), row(height - 1) + n, edge.data());
+            for (int y = height - 1; y >= 0; y--) {
+                recursiveStep(
+                        row(y), row(y), y + 1 < height ? row(y + 1) : edge.data(),
+                        y + 2 < height ? row(y + 2) : edge.data(), y + 3 < height ? row(y + 3) : edge.data(), n, k
+                );
+            }
+        }
+    });
+}
+
+int GaussianFilter::getRadius() {
+    double s = (sigma > 0) ? sigma : 0.3 * ((filter_size - 1) * 0.5 - 1) + 0.8;
+    if (mode != RECURSIVE || s < 0.5)
+        return filter_size / 2;
+    return (int) std::ceil(4 * s);
+}
+
+void GaussianFilter::rescale(double factor) {
+    Filter::rescale(factor);
+    sigma *= factor;
+}
+
+std::string GaussianFilter::cacheKey() {
+    std::ostringstream key;
+    key.precision(17);
+    key << "Gaussian " << filter_size << ' ' << sigma << ' ' << mode;
+    return key.str();
+}
+
+void GaussianFilter::apply(cv::InputArray image, cv::OutputArray output) {
+    // Same default sigma as cv::GaussianBlur.
+    double s = (sigma > 0) ? sigma : 0.3 * ((filter_size - 1) * 0.5 - 1) + 0.8;
+    if (mode != RECURSIVE || s < 0.5) {
+        cv::GaussianBlur(image, output, cv::Size(filter_size, filter_size), sigma, sigma);
+        return;
+    }
+
+    // Columns are blurred with whole rows at a time, which vectorizes. Rows are blurred the same way on the
+    // transposed image, instead of walking along each row.
+    RecursiveGaussian k(s);
+    FilterScratch::Lease buffers(scratch, 2);
+    cv::Mat &blurred = buffers[0];
+    cv::Mat &transposed = buffers[1];
+    int type = image.type();
+    image.getMat().convertTo(blurred, CV_32F);
+    cv::Mat columns = blurred.reshape(1);
+    recursiveColumns(columns, k);
+    cv::transpose(blurred, transposed);
+    columns = transposed.reshape(1);
+    recursiveColumns(columns, k);
+    cv::transpose(transposed, blurred);
+    blurred.convertTo(output, type);
 }
 
 
 // Median Filter ---
+
+/**
+ * h += add, on histograms of n bins, n multiple of 8.
+ */
+static inline void addHistogram(uint16_t *h, const uint16_t *add, int n) {
+#if CV_SIMD128
+    for (int i = 0; i < n; i += 8)
+        cv::v_store(h + i, cv::v_load(h + i) + cv::v_load(add + i));
+#else
+    for (int i = 0; i < n; i++)
+        h[i] += add[i];
+#endif
+}
+
+/**
+ * h += add - sub, on histograms of n bins, n multiple of 8. Counts never overflow nor go below zero, since sub is
+ * always part of h.
+ */
+static inline void slideHistogram(uint16_t *h, const uint16_t *add, const uint16_t *sub, int n) {
+#if CV_SIMD128
+    for (int i = 0; i < n; i += 8)
+        cv::v_store(h + i, cv::v_load(h + i) + cv::v_load(add + i) - cv::v_load(sub + i));
+#else
+    for (int i = 0; i < n; i++)
+        h[i] += add[i] - sub[i];
+#endif
+}
+
+// Histograms of medianStripe(), kept by each thread across its stripes.
+struct MedianHistograms {
+    std::vector<uint16_t> column_coarse;
+    std::vector<uint16_t> column_fine;
+    std::vector<uint16_t> kernel_coarse;
+    std::vector<uint16_t> kernel_fine;
+    // Column at which each fine histogram of the window was last updated.
+    std::vector<int> updated;
+};
+
+/**
+ * Median filter on the columns [x0, x1) of an image, with replicated borders. Values are split in COARSE_BITS high
+ * bits and FINE_BITS low bits.
+ *
+ * @param src The image.
+ * @param dst The output, same size and type.
+ * @param r The radius of the window.
+ * @param x0 First column.
+ * @param x1 Column after the last.
+ * @param histograms Buffers for the histograms, grown as needed.
+ */
+template<typename T, int COARSE_BITS, int FINE_BITS>
+static void medianStripe(const cv::Mat &src, cv::Mat &dst, int r, int x0, int x1, MedianHistograms &histograms) {
+    const int C = 1 << COARSE_BITS;
+    const int F = 1 << FINE_BITS;
+    int width = src.cols;
+    int height = src.rows;
+    int cn = src.channels();
+    int window = 2 * r + 1;
+    int rank = window * window / 2;
+
+    // Histograms of the columns the windows reach, borders being replicated.
+    int g0 = std::max(0, x0 - r);
+    int g1 = std::min(width, x1 + r);
+    int n = g1 - g0;
+    auto column = [&](int x) { return std::min(std::max(x, 0), width - 1) - g0; };
+    std::vector<uint16_t> &column_coarse = histograms.column_coarse;
+    std::vector<uint16_t> &column_fine = histograms.column_fine;
+    std::vector<uint16_t> &kernel_coarse = histograms.kernel_coarse;
+    std::vector<uint16_t> &kernel_fine = histograms.kernel_fine;
+    std::vector<int> &updated = histograms.updated;
+    column_coarse.resize(n * C);
+    column_fine.resize(n * C * F);
+    kernel_coarse.resize(C);
+    kernel_fine.resize(C * F);
+    updated.resize(C);
+
+    auto update = [&](const T *row, int c, int delta) {
+        for (int g = 0; g < n; g++) {
+            int value = row[(g0 + g) * cn + c];
+            column_coarse[g * C + (value >> FINE_BITS)] += delta;
+            column_fine[(g * C + (value >> FINE_BITS)) * F + (value & (F - 1))] += delta;
+        }
+    };
+
+    for (int c = 0; c < cn; c++) {
+        std::fill(column_coarse.begin(), column_coarse.begin() + n * C, 0);
+        std::fill(column_fine.begin(), column_fine.begin() + n * C * F, 0);
+        for (int dy = -r; dy <= r; dy++)
+            update(src.ptr<T>(std::min(std::max(dy, 0), height - 1)), c, 1);
+
+        for (int y = 0; y < height; y++) {
+            // Move the columns down one row.
+            if (y > 0) {
+                int out = std::max(y - r - 1, 0);
+                int in = std::min(y + r, height - 1);
+                if (out != in) {
+                    update(src.ptr<T>(out), c, -1);
+                    update(src.ptr<T>(in), c, 1);
+                }
+            }
+
+            // Window of the first column. Fine histograms are rebuilt only when needed.
+            std::fill(kernel_coarse.begin(), kernel_coarse.end(), 0);
+            for (int dx = -r; dx <= r; dx++)
+                addHistogram(kernel_coarse.data(), &column_coarse[column(x0 + dx) * C], C);
+            std::fill(updated.begin(), updated.end(), std::numeric_limits<int>::min() / 2);
+
+            T *out = dst.ptr<T>(y);
+            for (int x = x0; x < x1; x++) {
+                if (x > x0)
+                    slideHistogram(
+                            kernel_coarse.data(), &column_coarse[column(x + r) * C],
+                            &column_coarse[column(x - r - 1) * C], C
+                    );
+
+                // Coarse bin of the median.
+                int sum = 0;
+                int b = 0;
+                while (sum + kernel_coarse[b] <= rank)
+                    sum += kernel_coarse[b++];
+
+                // Bring the fine histogram of that bin to this column, from scratch if it is too far behind.
+                uint16_t *fine = &kernel_fine[b * F];
+                if (x - updated[b] >= window) {
+                    std::fill(fine, fine + F, 0);
+                    for (int dx = -r; dx <= r; dx++)
+                        addHistogram(fine, &column_fine[(column(x + dx) * C + b) * F], F);
+                } else {
+                    for (int s = updated[b] + 1; s <= x; s++)
+                        slideHistogram(
+                                fine, &column_fine[(column(s + r) * C + b) * F],
+                                &column_fine[(column(s - r - 1) * C + b) * F], F
+                        );
+                }
+                updated[b] = x;
+
+                int f = 0;
+                while (sum + fine[f] <= rank)
+                    sum += fine[f++];
+                out[x * cn + c] = (T) ((b << FINE_BITS) | f);
+            }
+        }
+    }
+}
+
 MedianFilter::MedianFilter(int filter_size) : Filter(filter_size) {}
 
-void MedianFilter::apply(cv::Mat &image, cv::Mat &output) {
-    cv::medianBlur(image, output, filter_size);
+std::string MedianFilter::cacheKey() {
+    return "Median " + std::to_string(filter_size);
+}
+
+void MedianFilter::apply(cv::InputArray image, cv::OutputArray output) {
+    FilterScratch::Lease buffers(scratch, 1);
+    cv::Mat src = unaliased(image.getMat(), output, buffers[0]);
+
+    // Sorting networks are faster for tiny windows.
+    if (filter_size <= 5) {
+        cv::medianBlur(src, output, filter_size);
+        return;
+    }
+    CV_Assert((src.depth() == CV_8U || src.depth() == CV_16U) && filter_size <= 255);
+
+    output.create(src.size(), src.type());
+    cv::Mat dst = output.getMat();
+    int r = filter_size / 2;
+
+    // Split the columns in stripes, one per thread, each also reading r columns on its sides. 16 bit histograms are
+    // 256 times bigger, so their stripes are kept narrow to bound the memory, at the cost of rebuilding the window
+    // histogram of each row over fewer pixels.
+    int threads = std::max(cv::getNumThreads(), 1);
+    int stripe = std::max((src.cols + threads - 1) / threads, 2 * r + 1);
+    if (src.depth() == CV_16U)
+        stripe = std::min(stripe, std::max(128 - 2 * r, 32));
+    int stripes = (src.cols + stripe - 1) / stripe;
+
+    cv::parallel_for_(cv::Range(0, stripes), [&](const cv::Range &range) {
+        MedianHistograms histograms;
+        for (int i = range.start; i < range.end; i++) {
+            int x0 = i * stripe;
+            int x1 = std::min(x0 + stripe, src.cols);
+            if (src.depth() == CV_8U)
+                medianStripe<uchar, 4, 4>(src, dst, r, x0, x1, histograms);
+            else
+                medianStripe<ushort, 8, 8>(src, dst, r, x0, x1, histograms);
+        }
+    });
 }
 
 
@@ -64,8 +444,213 @@ BilateralFilter::BilateralFilter(int filter_size, double sigma_range, double sig
     this->filter_size = 15;
 }
 
-void BilateralFilter::apply(cv::Mat &image, cv::Mat &output) {
-    cv::bilateralFilter(image, output, filter_size, sigma_range, sigma_space);
+void BilateralFilter::apply(cv::InputArray image, cv::OutputArray output) {
+    cv::Mat src = image.getMat();
+    if (mode == GRID && applyGrid(src, output))
+        return;
+    // When the grid falls back, use the filter it approximates, with a window fitting sigma_space as in exactError(),
+    // rather than the fixed window of the EXACT mode.
+    int window = (mode == GRID) ? 0 : filter_size;
+    FilterScratch::Lease buffers(scratch, 1);
+    cv::bilateralFilter(unaliased(src, output, buffers[0]), output, window, sigma_range, sigma_space);
+}
+
+int BilateralFilter::getRadius() {
+    return (mode == GRID) ? -1 : filter_size / 2;
+}
+
+void BilateralFilter::rescale(double factor) {
+    // The range sigma is in intensity levels, which do not change.
+    Filter::rescale(factor);
+    sigma_space *= factor;
+}
+
+std::string BilateralFilter::cacheKey() {
+    std::ostringstream key;
+    key.precision(17);
+    key << "Bilateral " << filter_size << ' ' << sigma_range << ' ' << sigma_space << ' ' << mode;
+    // The grid scale only matters in GRID mode.
+    if (mode == GRID)
+        key << ' ' << grid_scale;
+    return key.str();
+}
+
+void BilateralFilter::setMode(int new_mode) {
+    mode = new_mode;
+}
+
+void BilateralFilter::setGridScale(double scale) {
+    CV_Assert(scale > 0);
+    grid_scale = scale;
+}
+
+double BilateralFilter::exactError(const cv::Mat &image) {
+    cv::Mat approximate;
+    cv::Mat exact;
+    apply(image, approximate);
+    // A non positive size makes OpenCV fit the window to sigma_space.
+    cv::bilateralFilter(image, exact, 0, sigma_range, sigma_space);
+    return cv::norm(approximate, exact, cv::NORM_L2) / std::sqrt((double) image.total() * image.channels());
+}
+
+/**
+ * Blur a grid along one axis, seeing it as [outer][length][inner] floats. The grid has as many empty cells as the
+ * kernel radius on each side, so no border handling is needed.
+ *
+ * @param grid The grid.
+ * @param outer Product of the sizes of the axes before.
+ * @param length Size of the axis.
+ * @param inner Product of the sizes of the axes after, times the floats per cell.
+ * @param kernel The gaussian kernel, of odd size.
+ */
+static void blurGridAxis(float *grid, int outer, int length, int inner, const std::vector<float> &kernel) {
+    const int CHUNK = 256;
+    int radius = (int) kernel.size() / 2;
+    int chunks = (inner + CHUNK - 1) / CHUNK;
+
+    cv::parallel_for_(cv::Range(0, outer * chunks), [&](const cv::Range &range) {
+        std::vector<float> line(length * CHUNK);
+        for (int task = range.start; task < range.end; task++) {
+            float *block = grid + (size_t) (task / chunks) * length * inner;
+            int s0 = (task % chunks) * CHUNK;
+            int s1 = std::min(s0 + CHUNK, inner);
+            int n = s1 - s0;
+
+            // Copy the lines aside, then write the blurred ones back in place.
+            for (int i = 0; i < length; i++)
+                std::copy(block + (size_t) i * inner + s0, block + (size_t) i * inner + s1, &line[i * CHUNK]);
+            for (int i = radius; i < length - radius; i++) {
+                float *out = block + (size_t) i * inner + s0;
+                std::fill(out, out + n, 0.f);
+                for (int t = -radius; t <= radius; t++) {
+                    const float *in = &line[(i + t) * CHUNK];
+                    float weight = kernel[t + radius];
+                    for (int s = 0; s < n; s++)
+                        out[s] += weight * in[s];
+                }
+            }
+        }
+    });
+}
+
+/**
+ * @param sigma Standard deviation in grid cells.
+ * @return A normalized gaussian kernel reaching two sigmas.
+ */
+static std::vector<float> gridKernel(double sigma) {
+    int radius = std::max((int) std::ceil(2 * sigma), 1);
+    cv::Mat kernel = cv::getGaussianKernel(2 * radius + 1, sigma, CV_32F);
+    return std::vector<float>(kernel.begin<float>(), kernel.end<float>());
+}
+
+bool BilateralFilter::applyGrid(const cv::Mat &image, cv::OutputArray output) {
+    CV_Assert(image.channels() == 1 || image.channels() == 3);
+    int cn = image.channels();
+    int k = cn + 1;
+    int width = image.cols;
+    int height = image.rows;
+
+    // Same clamping of the sigmas as cv::bilateralFilter.
+    double space = sigma_space > 0 ? sigma_space : 1;
+    double range = sigma_range > 0 ? sigma_range : 1;
+    double cell_space = std::max(space * grid_scale, 1.0);
+    double cell_range = range * grid_scale;
+
+    // Float copy of the image, intensities, grid and float output.
+    FilterScratch::Lease buffers(scratch, 4);
+    cv::Mat &source = buffers[0];
+    image.convertTo(source, CV_32F);
+    cv::Mat guide = source;
+    if (cn == 3) {
+        cv::cvtColor(source, buffers[1], cv::COLOR_BGR2GRAY);
+        guide = buffers[1];
+    }
+    double low = 0;
+    double high = 0;
+    cv::minMaxLoc(guide, &low, &high);
+
+    // Grid size, with empty cells around as wide as the blur.
+    std::vector<float> kernel_space = gridKernel(space / cell_space);
+    std::vector<float> kernel_range = gridKernel(range / cell_range);
+    int pad_space = (int) kernel_space.size() / 2;
+    int pad_range = (int) kernel_range.size() / 2;
+    int grid_width = (int) ((width - 1) / cell_space) + 2 + 2 * pad_space;
+    int grid_height = (int) ((height - 1) / cell_space) + 2 + 2 * pad_space;
+    int grid_depth = (int) ((high - low) / cell_range) + 2 + 2 * pad_range;
+    // Small sigmas make grids bigger than the image, and the exact filter is quick on them anyway.
+    if ((double) grid_width * grid_height * grid_depth > (double) width * height)
+        return false;
+    buffers[2].create(1, grid_width * grid_height * grid_depth * k, CV_32F);
+    buffers[2].setTo(0);
+    float *grid = buffers[2].ptr<float>();
+    auto cell = [&](int gx, int gy, int gz) {
+        return grid + (((size_t) gy * grid_width + gx) * grid_depth + gz) * k;
+    };
+
+    // Splat each pixel in its nearest cell. Rows of cells are independent, so each is filled by a single thread.
+    std::vector<int> first_row(grid_height + 1, height);
+    for (int y = height - 1; y >= 0; y--)
+        first_row[(int) (y / cell_space + 0.5) + pad_space] = y;
+    for (int gy = grid_height - 1; gy > 0; gy--)
+        first_row[gy - 1] = std::min(first_row[gy - 1], first_row[gy]);
+    cv::parallel_for_(cv::Range(0, grid_height), [&](const cv::Range &rows) {
+        for (int gy = rows.start; gy < rows.end; gy++) {
+            for (int y = first_row[gy]; y < first_row[gy + 1]; y++) {
+                const float *pixel = source.ptr<float>(y);
+                const float *intensity = guide.ptr<float>(y);
+                for (int x = 0; x < width; x++) {
+                    int gx = (int) (x / cell_space + 0.5) + pad_space;
+                    int gz = (int) ((intensity[x] - low) / cell_range + 0.5) + pad_range;
+                    float *target = cell(gx, gy, gz);
+                    for (int c = 0; c < cn; c++)
+                        target[c] += pixel[x * cn + c];
+                    target[cn] += 1;
+                }
+            }
+        }
+    });
+
+    // Blur along intensity, x and y.
+    blurGridAxis(grid, grid_height * grid_width, grid_depth, k, kernel_range);
+    blurGridAxis(grid, grid_height, grid_width, grid_depth * k, kernel_space);
+    blurGridAxis(grid, 1, grid_height, grid_width * grid_depth * k, kernel_space);
+
+    // Slice: interpolate each pixel from the 8 cells around it, and normalize by the accumulated weight.
+    cv::Mat &result = buffers[3];
+    result.create(image.size(), source.type());
+    cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &rows) {
+        std::vector<float> sum(k);
+        for (int y = rows.start; y < rows.end; y++) {
+            const float *intensity = guide.ptr<float>(y);
+            const float *pixel = source.ptr<float>(y);
+            float *out = result.ptr<float>(y);
+            float fy = (float) (y / cell_space) + pad_space;
+            int gy = (int) fy;
+            float wy = fy - gy;
+            for (int x = 0; x < width; x++) {
+                float fx = (float) (x / cell_space) + pad_space;
+                float fz = (float) ((intensity[x] - low) / cell_range) + pad_range;
+                int gx = (int) fx;
+                int gz = (int) fz;
+                float wx = fx - gx;
+                float wz = fz - gz;
+                std::fill(sum.begin(), sum.end(), 0.f);
+                for (int corner = 0; corner < 8; corner++) {
+                    int dx = corner & 1;
+                    int dy = (corner >> 1) & 1;
+                    int dz = corner >> 2;
+                    float weight = (dx ? wx : 1 - wx) * (dy ? wy : 1 - wy) * (dz ? wz : 1 - wz);
+                    const float *source_cell = cell(gx + dx, gy + dy, gz + dz);
+                    for (int c = 0; c < k; c++)
+                        sum[c] += weight * source_cell[c];
+                }
+                for (int c = 0; c < cn; c++)
+                    out[x * cn + c] = sum[cn] > 0 ? sum[c] / sum[cn] : pixel[x * cn + c];
+            }
+        }
+    });
+    result.convertTo(output, image.type());
+    return true;
 }
 
 void BilateralFilter::setSigmaRange(double sigma) {
@@ -76,4 +661,360 @@ void BilateralFilter::setSigmaSpace(double sigma) {
     sigma_space = sigma;
     //filter_size = (int) (6 * sigma_space);
     filter_size = 15;
-}
\ No newline at end of file
+}
+
+
+// Convolution Filter ---
+
+// Rough costs, relative to a multiply-add of the direct convolution, of a butterfly of the FFT and of a bin of the
+// spectrum product.
+static const double FFT_BUTTERFLY_COST = 2.0;
+static const double FFT_PRODUCT_COST = 4.0;
+
+// Kernel areas from which cv::filter2D switches to a DFT, for 8 bit and float images, and for other depths.
+static const double DFT_KERNEL_AREA_FAST = 130;
+static const double DFT_KERNEL_AREA = 50;
+
+// Ratio of the singular values below which the kernel is deemed rank one.
+static const double SEPARABLE_TOLERANCE = 1e-6;
+
+ConvolutionFilter::ConvolutionFilter(const cv::Mat &kernel) : Filter(std::max(kernel.rows, kernel.cols)) {
+    setKernel(kernel);
+}
+
+void ConvolutionFilter::setKernel(const cv::Mat &new_kernel) {
+    CV_Assert(new_kernel.channels() == 1 && !new_kernel.empty());
+    new_kernel.convertTo(kernel, CV_32F);
+    filter_size = std::max(kernel.rows, kernel.cols);
+    spectra.clear();
+
+    // Rank one kernels are the outer product of their first singular vectors. In double precision, since the noise
+    // of a float decomposition on the second singular value would exceed the tolerance on large kernels.
+    cv::Mat precise;
+    kernel.convertTo(precise, CV_64F);
+    cv::SVD svd(precise);
+    double first = svd.w.at<double>(0);
+    double second = svd.w.rows > 1 ? svd.w.at<double>(1) : 0;
+    separable = first > 0 && second / first < SEPARABLE_TOLERANCE;
+    if (separable) {
+        cv::Mat(svd.vt.row(0) * std::sqrt(first)).convertTo(kernel_x, CV_32F);
+        cv::Mat(svd.u.col(0) * std::sqrt(first)).convertTo(kernel_y, CV_32F);
+    } else {
+        kernel_x.release();
+        kernel_y.release();
+    }
+}
+
+bool ConvolutionFilter::isSeparable() const {
+    return separable;
+}
+
+int ConvolutionFilter::choosePath(const cv::Size &size, int depth) const {
+    double pixels = (double) size.area();
+    double padded = (double) cv::getOptimalDFTSize(size.width + kernel.cols - 1) *
+                    cv::getOptimalDFTSize(size.height + kernel.rows - 1);
+    double transform = FFT_BUTTERFLY_COST * padded * std::log2(padded);
+    // A forward and an inverse transform, and the product of the spectra.
+    double fft = 2 * transform + FFT_PRODUCT_COST * padded;
+
+    // cv::filter2D runs its own DFT on large kernels, which transforms the kernel too on every call.
+    double dft_area = (depth == CV_8U || depth == CV_32F) ? DFT_KERNEL_AREA_FAST : DFT_KERNEL_AREA;
+    double direct;
+    if (separable)
+        direct = pixels * (kernel.rows + kernel.cols);
+    else if ((double) kernel.total() >= dft_area)
+        direct = fft + transform;
+    else
+        direct = pixels * kernel.total();
+
+    if (fft < direct)
+        return FFT;
+    return separable ? SEPARABLE : DIRECT;
+}
+
+int ConvolutionFilter::getRadius() {
+    // The anchor is at the center, so the longer side is before it.
+    return std::max(kernel.rows, kernel.cols) / 2;
+}
+
+std::string ConvolutionFilter::cacheKey() {
+    std::ostringstream key;
+    key << "Convolution " << kernel.rows << 'x' << kernel.cols << ' ' << std::hex << hashPixels(kernel);
+    return key.str();
+}
+
+void ConvolutionFilter::apply(cv::InputArray image, cv::OutputArray output) {
+    switch (choosePath(image.size(), image.depth())) {
+        case FFT:
+            applyFFT(image.getMat(), output);
+            break;
+        case SEPARABLE:
+            cv::sepFilter2D(image, output, -1, kernel_x, kernel_y);
+            break;
+        default:
+            cv::filter2D(image, output, -1, kernel);
+    }
+}
+
+void ConvolutionFilter::applyFFT(const cv::Mat &image, cv::OutputArray output) {
+    int kw = kernel.cols;
+    int kh = kernel.rows;
+    int ax = kw / 2;
+    int ay = kh / 2;
+    cv::Size padded(cv::getOptimalDFTSize(image.cols + kw - 1), cv::getOptimalDFTSize(image.rows + kh - 1));
+
+    // Correlating with the kernel is convolving with it flipped, placed at the origin.
+    cv::Mat spectrum;
+    {
+        std::lock_guard<std::mutex> lock(spectra_mutex);
+        cv::Mat &cached = spectra[std::make_pair(padded.width, padded.height)];
+        if (cached.empty()) {
+            cv::Mat flipped = cv::Mat::zeros(padded, CV_32F);
+            cv::flip(kernel, flipped(cv::Rect(0, 0, kw, kh)), -1);
+            cv::dft(flipped, cached, 0, kh);
+        }
+        spectrum = cached;
+    }
+
+    // A channel, as is and as float, the padded channel, its product with the kernel, and the output channels.
+    int cn = image.channels();
+    FilterScratch::Lease buffers(scratch, 4 + cn);
+    cv::Mat &channel = buffers[0];
+    cv::Mat &plane = buffers[1];
+    cv::Mat &bordered = buffers[2];
+    cv::Mat &product = buffers[3];
+    bordered.create(padded, CV_32F);
+    bordered.setTo(0);
+    for (int c = 0; c < cn; c++) {
+        // Same border as cv::filter2D, the rest of the padding is only there to reach a fast transform size.
+        cv::extractChannel(image, channel, c);
+        channel.convertTo(plane, CV_32F);
+        cv::copyMakeBorder(
+                plane, bordered(cv::Rect(0, 0, image.cols + kw - 1, image.rows + kh - 1)),
+                ay, kh - 1 - ay, ax, kw - 1 - ax, cv::BORDER_REFLECT_101
+        );
+        cv::dft(bordered, product, 0, image.rows + kh - 1);
+        cv::mulSpectrums(product, spectrum, product, 0);
+        cv::dft(product, product, cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT, image.rows + kh - 1);
+        product(cv::Rect(kw - 1, kh - 1, image.cols, image.rows)).convertTo(buffers[4 + c], image.depth());
+    }
+    // The image is read in full before the output is written, so they may be the same.
+    cv::merge(&buffers[4], cn, output);
+}
+
+
+// Filter Pipeline ---
+FilterPipeline::FilterPipeline(size_t strip_bytes) : Filter(1), strip_bytes(strip_bytes) {}
+
+FilterPipeline &FilterPipeline::add(Filter &filter) {
+    stages.push_back(&filter);
+    return *this;
+}
+
+int FilterPipeline::getRadius() {
+    int radius = 0;
+    for (auto stage : stages) {
+        int r = stage->getRadius();
+        if (r < 0)
+            return -1;
+        radius += r;
+    }
+    return radius;
+}
+
+std::string FilterPipeline::cacheKey() {
+    std::string key = "Pipeline (";
+    for (auto stage : stages)
+        key += stage->cacheKey() + "; ";
+    return key + ")";
+}
+
+void FilterPipeline::releaseScratch() {
+    Filter::releaseScratch();
+    intermediate[0].release();
+    intermediate[1].release();
+    std::lock_guard<std::mutex> lock(arenas_mutex);
+    arenas.clear();
+}
+
+void FilterPipeline::apply(cv::InputArray image, cv::OutputArray output) {
+    if (stages.empty()) {
+        Filter::apply(image, output);
+        return;
+    }
+
+    // Split the chain at the filters that need the whole image. Each part writes to the output if it is the last, to
+    // an intermediate image otherwise.
+    cv::Mat current = image.getMat();
+    int next = 0;
+    for (size_t first = 0; first < stages.size();) {
+        size_t last = first + 1;
+        bool whole = stages[first]->getRadius() < 0;
+        if (!whole) {
+            while (last < stages.size() && stages[last]->getRadius() >= 0)
+                last++;
+        }
+
+        bool final = last == stages.size();
+        cv::Mat &buffer = intermediate[next];
+        next = 1 - next;
+        cv::_OutputArray destination = final ? output : cv::_OutputArray(buffer);
+        // Filters work in place if the output is the image.
+        if (whole)
+            stages[first]->apply(current, destination);
+        else
+            applyStrips(first, last, current, destination);
+        if (!final)
+            current = buffer;
+        first = last;
+    }
+}
+
+void FilterPipeline::applyStrips(size_t first, size_t last, const cv::Mat &image, cv::OutputArray output) {
+    int height = image.rows;
+    int n = (int) (last - first);
+    // Rows needed around a strip before each filter, so that the rows of the strip are exact after the last one.
+    std::vector<int> halo(n + 1, 0);
+    for (int k = n - 1; k >= 0; k--)
+        halo[k] = halo[k + 1] + stages[first + k]->getRadius();
+
+    // Strips as tall as the cache allows, but not much thinner than their halo, or rows would be filtered many times.
+    size_t row_bytes = image.cols * image.elemSize();
+    int strip_rows = (int) (strip_bytes / std::max(row_bytes, (size_t) 1)) - 2 * halo[0];
+    strip_rows = std::min(std::max(strip_rows, std::max(halo[0], 16)), height);
+    int strips = (height + strip_rows - 1) / strip_rows;
+    int buffer_rows = std::min(height, strip_rows + 2 * halo[0]);
+
+    // Strips are written in the output as soon as they are done, so the output cannot be the input.
+    FilterScratch::Lease buffers(scratch, 1);
+    cv::Mat source = unaliased(image, output, buffers[0]);
+    output.create(image.size(), image.type());
+    cv::Mat destination = output.getMat();
+
+    cv::parallel_for_(cv::Range(0, strips), [&](const cv::Range &range) {
+        // Two strip buffers, each filter reads one and writes the other.
+        std::vector<uchar> arena;
+        {
+            std::lock_guard<std::mutex> lock(arenas_mutex);
+            if (!arenas.empty()) {
+                arena = std::move(arenas.back());
+                arenas.pop_back();
+            }
+        }
+        arena.resize(2 * buffer_rows * row_bytes);
+        uchar *buffers[2] = {arena.data(), arena.data() + buffer_rows * row_bytes};
+
+        for (int s = range.start; s < range.end; s++) {
+            int y0 = s * strip_rows;
+            int y1 = std::min(y0 + strip_rows, height);
+            int top = std::max(y0 - halo[0], 0);
+            int bottom = std::min(y1 + halo[0], height);
+
+            // Headers of the exact size rather than ROIs, so filters handle the strip borders as image borders
+            // instead of reading around them.
+            cv::Mat input(bottom - top, image.cols, image.type(), (void *) source.ptr(top), source.step);
+            for (int k = 0; k < n; k++) {
+                cv::Mat filtered(input.rows, input.cols, input.type(), buffers[k % 2]);
+                stages[first + k]->apply(input, filtered);
+
+                // Keep only the rows the next filters need.
+                int next_top = std::max(y0 - halo[k + 1], 0);
+                int next_bottom = std::min(y1 + halo[k + 1], height);
+                input = cv::Mat(
+                        next_bottom - next_top, filtered.cols, filtered.type(),
+                        filtered.ptr(next_top - top), filtered.step
+                );
+                top = next_top;
+            }
+            input.copyTo(destination.rowRange(y0, y1));
+        }
+
+        std::lock_guard<std::mutex> lock(arenas_mutex);
+        arenas.push_back(std::move(arena));
+    });
+}
+
+
+// Filter Cache ---
+FilterCache::FilterCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+void FilterCache::apply(Filter &filter, const cv::Mat &image, cv::Mat &output) {
+    std::string image_key = key(filter, image);
+    if (find(image_key, output))
+        return;
+    filter.apply(image, output);
+    insert(image_key, output);
+}
+
+std::string FilterCache::key(Filter &filter, const cv::Mat &image) {
+    return key(filter, imageKey(image));
+}
+
+std::string FilterCache::key(Filter &filter, const std::string &image_key) {
+    return filter.cacheKey() + " | " + image_key;
+}
+
+std::string FilterCache::imageKey(const cv::Mat &image) {
+    std::ostringstream key;
+    key << image.cols << 'x' << image.rows << ' ' << image.type() << ' ' << std::hex << hashPixels(image);
+    return key.str();
+}
+
+bool FilterCache::find(const std::string &key, cv::Mat &output) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(key);
+    if (it == index.end()) {
+        miss_count++;
+        return false;
+    }
+    hit_count++;
+    entries.splice(entries.begin(), entries, it->second);
+    it->second->second.copyTo(output);
+    return true;
+}
+
+void FilterCache::insert(const std::string &key, const cv::Mat &image) {
+    size_t size = image.total() * image.elemSize();
+    if (size > max_bytes)
+        return;
+    cv::Mat copy = image.clone();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // Another thread may have computed it too.
+    auto it = index.find(key);
+    if (it != index.end()) {
+        entries.splice(entries.begin(), entries, it->second);
+        return;
+    }
+    while (used_bytes + size > max_bytes) {
+        cv::Mat &oldest = entries.back().second;
+        used_bytes -= oldest.total() * oldest.elemSize();
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.emplace_front(key, copy);
+    index[key] = entries.begin();
+    used_bytes += size;
+}
+
+void FilterCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    index.clear();
+    used_bytes = 0;
+}
+
+size_t FilterCache::hits() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hit_count;
+}
+
+size_t FilterCache::misses() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return miss_count;
+}
+
+size_t FilterCache::bytes() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return used_bytes;
+}
@@ -1,6 +1,66 @@
+#ifndef LAB3_FILTER_H
+#define LAB3_FILTER_H
+
 #include <opencv2/core.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * Buffers of a filter kept between calls, so that calls on images of the same size do not allocate. Threads calling a
+ * filter at once take turns: the first one gets the buffers, the others get their own, freed at the end of the call.
+ * Copies of a filter start with no buffers.
+ */
+class FilterScratch {
+
+public:
+
+    FilterScratch() = default;
+
+    FilterScratch(const FilterScratch &) {}
+
+    FilterScratch &operator=(const FilterScratch &) { return *this; }
+
+    /**
+     * Free the buffers, waiting for a call using them to end.
+     */
+    void release();
+
+    /**
+     * The buffers, for the length of a call.
+     */
+    class Lease {
+
+    public:
+
+        /**
+         * @param scratch The buffers of the filter.
+         * @param count How many buffers the call needs.
+         */
+        Lease(FilterScratch &scratch, size_t count);
+
+        cv::Mat &operator[](size_t i);
+
+    private:
+
+        std::unique_lock<std::mutex> lock;
+        std::vector<cv::Mat> local;
+        std::vector<cv::Mat> *buffers;
+
+    };
+
+private:
+
+    std::vector<cv::Mat> buffers;
+    std::mutex mutex;
+
+};
 
 /**
  * Base class for a square convolutional filter.
@@ -14,12 +74,15 @@ public:
      */
     explicit Filter(int filter_size);
 
+    virtual ~Filter() = default;
+
     /**
      * Apply filter to an image.
      * @param image The image to filter.
-     * @param output The output of the convolution.
+     * @param output The output of the convolution. Reused if it already has the size and type of the image, and may be
+     * the image itself.
      */
-    virtual void apply(cv::Mat &image, cv::Mat &output);
+    virtual void apply(cv::InputArray image, cv::OutputArray output);
 
     /**
      * Change the filter size.
@@ -33,20 +96,64 @@ public:
      */
     int getSize();
 
+    /**
+     * How many rows (columns) of input around an output pixel affect it.
+     * @return The radius, or -1 if the filter needs the whole image.
+     */
+    virtual int getRadius();
+
+    /**
+     * Adapt the parameters measured in pixels to an image resized by a factor, e.g. to preview a smaller copy of it.
+     * @param factor The resize factor.
+     */
+    virtual void rescale(double factor);
+
+    /**
+     * Describe the filter with its parameters, for FilterCache. Filters giving different outputs must have different
+     * keys.
+     * @return The key. For the base class, the type of the filter and its size.
+     */
+    virtual std::string cacheKey();
+
+    /**
+     * Free the buffers kept between calls (see FilterScratch), e.g. once the filter is idle. The next call allocates
+     * them again.
+     */
+    virtual void releaseScratch();
+
 // Fields.
 
 protected:
 
     int filter_size;
 
+    // Buffers kept between calls.
+    FilterScratch scratch;
+
+    /**
+     * For filters that cannot work in place.
+     * @param image The image to filter.
+     * @param output The output.
+     * @param buffer Where to copy the image.
+     * @return The image, or its copy in buffer if the output is the image itself.
+     */
+    static cv::Mat unaliased(const cv::Mat &image, cv::OutputArray output, cv::Mat &buffer);
+
 };
 
 /**
  * Class for a Gaussian filter.
+ * In RECURSIVE mode the filter is approximated with the recursive filter of Young and van Vliet, a forward and a
+ * backward pass of a third order IIR filter, whose cost per pixel does not depend on sigma. The size is ignored, the
+ * support is the whole image. Sigmas below 0.5 fall back to the exact filter.
  */
 class GaussianFilter : public Filter {
 
 public:
+
+    static const int EXACT = 0;
+    static const int RECURSIVE = 1;
+
     /**
      * @param filter_size Size of the filter.
      * @param sigma The standard deviation for the filter.
@@ -55,17 +162,40 @@ public:
 
     void setSigma(double sigma);
 
-    void apply(cv::Mat &image, cv::Mat &output) override;
+    /**
+     * @param mode EXACT or RECURSIVE.
+     */
+    void setMode(int mode);
+
+    void apply(cv::InputArray image, cv::OutputArray output) override;
+
+    /**
+     * @return In RECURSIVE mode, four sigmas, beyond which the response is negligible.
+     */
+    int getRadius() override;
+
+    void rescale(double factor) override;
+
+    std::string cacheKey() override;
 
 protected:
 
     // Standard deviation (sigma) for the Filter.
     double sigma;
 
+    // EXACT or RECURSIVE.
+    int mode = EXACT;
+
 };
 
 /**
  * Class for a Median Filter.
+ * Sizes up to 5 use cv::medianBlur. Larger sizes use the algorithm of Perreault and Hebert: each column keeps a
+ * histogram of its pixels in the window, and the histogram of the window slides along the row by adding and removing
+ * a single column. Histograms have a coarse and a fine level, so only the fine part around the median is updated.
+ * On 8 bit images the cost per pixel does not depend on the size. 16 bit histograms are too big to keep for wide
+ * stripes of columns, so there the cost per pixel still grows linearly with the size, although much slower than
+ * sorting the window. Larger sizes need 8 or 16 bit images, with any number of channels, and at most size 255.
  */
 class MedianFilter : public Filter {
 
@@ -76,28 +206,64 @@ public:
      */
     explicit MedianFilter(int filter_size);
 
-    void apply(cv::Mat &image, cv::Mat &output) override;
+    void apply(cv::InputArray image, cv::OutputArray output) override;
+
+    std::string cacheKey() override;
 
 };
 
 /**
  * Class for Bilateral Filter.
+ * In GRID mode the filter is approximated with a bilateral grid (Chen, Paris and Durand): pixels are accumulated in a
+ * coarse 3D grid over space and intensity, the grid is blurred, and the output is interpolated back from it. The grid
+ * gets smaller as the sigmas grow, so the cost does not grow with the spatial support. Color images use their
+ * luminance as intensity.
  */
 class BilateralFilter : public Filter {
 
 public:
 
+    static const int EXACT = 0;
+    static const int GRID = 1;
+
     /**
      * @param filter_size Size of the filter in pixels.
      */
     explicit BilateralFilter(int filter_size, double sigma_range, double sigma_space);
 
-    void apply(cv::Mat &image, cv::Mat &output) override;
+    void apply(cv::InputArray image, cv::OutputArray output) override;
 
     void setSigmaRange(double sigma);
 
     void setSigmaSpace(double sigma);
 
+    /**
+     * @param mode EXACT or GRID.
+     */
+    void setMode(int mode);
+
+    /**
+     * Trade quality for speed in GRID mode.
+     * @param scale Size of the cells of the grid, in sigmas. Smaller is more accurate and slower, defaults to 1.
+     */
+    void setGridScale(double scale);
+
+    /**
+     * Compare the output of the current mode with cv::bilateralFilter using a window fitting sigma_space. In GRID mode
+     * with sigmas too small for the grid, the filter falls back to that same exact filter and the error is 0.
+     * @param image The image to filter.
+     * @return The RMS difference, in levels of the image.
+     */
+    double exactError(const cv::Mat &image);
+
+    /**
+     * @return -1 in GRID mode, since the grid spans the intensities of the whole image.
+     */
+    int getRadius() override;
+
+    void rescale(double factor) override;
+
+    std::string cacheKey() override;
 
 protected:
 
@@ -107,4 +273,233 @@ protected:
     // Space.
     double sigma_space;
 
-};
\ No newline at end of file
+    // EXACT or GRID.
+    int mode = EXACT;
+
+    // Size of the grid cells in sigmas.
+    double grid_scale = 1;
+
+    /**
+     * The GRID mode.
+     * @param image The image to filter, with 1 or 3 channels.
+     * @param output The output, same size and type.
+     * @return false if the grid would be larger than the image, in which case nothing is done.
+     */
+    bool applyGrid(const cv::Mat &image, cv::OutputArray output);
+
+};
+
+/**
+ * Class for a filter with an arbitrary kernel, anchored at its center.
+ * Rank one kernels are split in a row and a column kernel. Each call picks the cheapest of direct, separable and FFT
+ * convolution for the image size. FFT convolution keeps the spectrum of the kernel for each padded size, so batches of
+ * same size images transform only the images.
+ */
+class ConvolutionFilter : public Filter {
+
+public:
+
+    static const int DIRECT = 0;
+    static const int SEPARABLE = 1;
+    static const int FFT = 2;
+
+    /**
+     * @param kernel The kernel, single channel. Correlated with the image, as in cv::filter2D.
+     */
+    explicit ConvolutionFilter(const cv::Mat &kernel);
+
+    /**
+     * @param kernel The new kernel.
+     */
+    void setKernel(const cv::Mat &kernel);
+
+    /**
+     * @return Whether the kernel is rank one.
+     */
+    bool isSeparable() const;
+
+    /**
+     * Estimate which way of convolving is the cheapest.
+     * @param size The size of the image.
+     * @param depth The depth of the image, which decides when cv::filter2D uses a DFT of its own.
+     * @return DIRECT, SEPARABLE or FFT.
+     */
+    int choosePath(const cv::Size &size, int depth = CV_8U) const;
+
+    void apply(cv::InputArray image, cv::OutputArray output) override;
+
+    int getRadius() override;
+
+    std::string cacheKey() override;
+
+protected:
+
+    // The kernel, as CV_32F.
+    cv::Mat kernel;
+
+    // Row and column kernels, if the kernel is separable.
+    cv::Mat kernel_x;
+    cv::Mat kernel_y;
+    bool separable = false;
+
+    // Spectra of the kernel by padded size (width, height). Strips of a FilterPipeline may fill it concurrently.
+    std::map<std::pair<int, int>, cv::Mat> spectra;
+    std::mutex spectra_mutex;
+
+    /**
+     * The FFT path.
+     * @param image The image to filter.
+     * @param output The output, same size and type.
+     */
+    void applyFFT(const cv::Mat &image, cv::OutputArray output);
+
+};
+
+/**
+ * A chain of filters, applied one after the other as a single filter.
+ * Filters that need only a neighbourhood run together on horizontal strips of the image small enough to stay in cache:
+ * each strip is read with as many extra rows as the radii of the filters add up to, goes through all of them, and only
+ * its own rows are written to the output. Intermediate strips live in arenas that are kept for the next calls, one
+ * per thread. Filters that need the whole image (see getRadius()) split the chain and run on whole images.
+ * Filters are not owned and must outlive the pipeline.
+ */
+class FilterPipeline : public Filter {
+
+public:
+
+    /**
+     * @param strip_bytes Size of each intermediate strip. About half the L2 cache leaves room for the filters.
+     */
+    explicit FilterPipeline(size_t strip_bytes = 256 * 1024);
+
+    /**
+     * Append a filter to the chain.
+     * @param filter The filter.
+     * @return The pipeline, to chain calls.
+     */
+    FilterPipeline &add(Filter &filter);
+
+    void apply(cv::InputArray image, cv::OutputArray output) override;
+
+    /**
+     * @return The sum of the radii of the filters, -1 if any needs the whole image.
+     */
+    int getRadius() override;
+
+    std::string cacheKey() override;
+
+    /**
+     * Also frees the strip arenas and the intermediate images. The filters of the chain keep their buffers.
+     */
+    void releaseScratch() override;
+
+protected:
+
+    std::vector<Filter *> stages;
+    size_t strip_bytes;
+
+    // Arenas not in use, for the strips.
+    std::vector<std::vector<uchar>> arenas;
+    std::mutex arenas_mutex;
+
+    // Whole images between filters that need the whole image.
+    cv::Mat intermediate[2];
+
+    /**
+     * Run the filters [first, last), all with a radius, on strips.
+     * @param first First filter.
+     * @param last Filter after the last.
+     * @param image The image to filter.
+     * @param output The output, same size and type.
+     */
+    void applyStrips(size_t first, size_t last, const cv::Mat &image, cv::OutputArray output);
+
+};
+
+/**
+ * Filtered images kept by filter, parameters and input, so that applying the same filter to the same image again
+ * costs a copy. Inputs are identified by a hash of their pixels, so a reloaded image hits too. When full, the least
+ * recently used images are dropped. Safe to use from many threads.
+ */
+class FilterCache {
+
+public:
+
+    /**
+     * @param max_bytes Most bytes of filtered images kept. Larger images are never kept.
+     */
+    explicit FilterCache(size_t max_bytes = 256 * 1048576);
+
+    /**
+     * Apply a filter, or copy its output if it is kept.
+     * @param filter The filter.
+     * @param image The image to filter.
+     * @param output The output. Reused if it has the right size and type.
+     */
+    void apply(Filter &filter, const cv::Mat &image, cv::Mat &output);
+
+    /**
+     * @param filter The filter.
+     * @param image The image to filter.
+     * @return The key of the output of the filter on the image, for find() and insert().
+     */
+    std::string key(Filter &filter, const cv::Mat &image);
+
+    /**
+     * Same as above, for callers that filter the same image many times and keep its imageKey().
+     * @param filter The filter.
+     * @param image_key The imageKey() of the image to filter.
+     * @return The key of the output of the filter on the image.
+     */
+    std::string key(Filter &filter, const std::string &image_key);
+
+    /**
+     * @param image An image.
+     * @return The part of the keys identifying the image: its size, type and a hash of its pixels.
+     */
+    std::string imageKey(const cv::Mat &image);
+
+    /**
+     * Copy a kept image, and mark it as the most recently used.
+     * @param key Its key.
+     * @param output Destination. Reused if it has the right size and type.
+     * @return false if it is not kept, in which case the output is left untouched.
+     */
+    bool find(const std::string &key, cv::Mat &output);
+
+    /**
+     * Keep a copy of an image, evicting the least recently used ones to make room.
+     * @param key Its key.
+     * @param image The image.
+     */
+    void insert(const std::string &key, const cv::Mat &image);
+
+    /**
+     * Drop every image. Counters are kept.
+     */
+    void clear();
+
+    size_t hits();
+
+    size_t misses();
+
+    /**
+     * @return Bytes of the kept images.
+     */
+    size_t bytes();
+
+protected:
+
+    // Images by recency, most recent first, and where each key is in it.
+    std::list<std::pair<std::string, cv::Mat>> entries;
+    std::unordered_map<std::string, std::list<std::pair<std::string, cv::Mat>>::iterator> index;
+
+    size_t max_bytes;
+    size_t used_bytes = 0;
+    size_t hit_count = 0;
+    size_t miss_count = 0;
+    std::mutex mutex;
+
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include "fleet.h"
+
+using namespace std;
+using namespace cv;
+
+vector<FleetCamera> readManifest(const string &file) {
+    ifstream input(file);
+    if (!input)
+        throw invalid_argument("Cannot read manifest " + file + ".");
+
+    vector<FleetCamera> cameras;
+    string line;
+    for (int number = 1; getline(input, line); number++) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#')
+            continue;
+
+        FleetCamera camera;
+        istringstream fields(line);
+        fields >> camera.data_dir >> camera.pattern_size.width >> camera.pattern_size.height
+               >> camera.unit_size >> camera.output;
+        if (fields.fail())
+            throw invalid_argument("Malformed line " + to_string(number) + " of manifest " + file + ".");
+        cameras.push_back(camera);
+    }
+    return cameras;
+}
+
+/**
+ * Detect the corners of a camera, calibrate it and save the calibration.
+ *
+ * @param camera The camera.
+ * @param detection How to search for the corners.
+ * @return The outcome, with the error if the camera could not be calibrated.
+ */
+static FleetResult calibrateFleetCamera(const FleetCamera &camera, const DetectionOptions &detection) {
+    FleetResult result;
+    result.camera = camera;
+    try {
+        auto start = chrono::steady_clock::now();
+        vector<string> files;
+        utils::fs::glob(camera.data_dir, "*.png", files);
+        vector<ViewDetection> views = detectViews(files, camera.pattern_size, detection, "");
+        vector<vector<Vec2f>> image_points;
+        string example_file;
+        for (auto &view : views) {
+            if (view.found) {
+                image_points.push_back(std::move(view.corners));
+                example_file = view.file;
+            }
+        }
+        result.views = (int) views.size();
+        result.found = (int) image_points.size();
+        auto detected = chrono::steady_clock::now();
+        result.detection_seconds = chrono::duration<double>(detected - start).count();
+        if (image_points.empty())
+            throw invalid_argument("No image had all corners.");
+
+        Mat example = imread(example_file);
+        Size size(example.cols, example.rows);
+        vector<vector<Vec3f>> object_points = getObjectPoints(
+                (int) image_points.size(), camera.pattern_size.height, camera.pattern_size.width, camera.unit_size
+        );
+        Mat camera_matrix;
+        vector<double> dist;
+        vector<Mat> rot;
+        vector<Mat> tra;
+        result.rms = calibrateCamera(object_points, image_points, size, camera_matrix, dist, rot, tra, 0);
+
+        CalibratedCamera calibrated = {camera_matrix, dist, size};
+        setCalibrationViews(calibrated, image_points);
+        prepareUndistortion(calibrated);
+        saveCamera(calibrated, camera.output);
+        result.calibration_seconds = chrono::duration<double>(chrono::steady_clock::now() - detected).count();
+    } catch (const exception &e) {
+        result.error = e.what();
+    }
+    return result;
+}
+
+vector<FleetResult> calibrateFleet(const vector<FleetCamera> &cameras, const DetectionOptions &detection) {
+    vector<FleetResult> results(cameras.size());
+
+    // One pool for everything: cameras are its tasks, and the images of each camera are nested tasks.
+    ThreadPool pool(detection.threads);
+    DetectionOptions shared = detection;
+    shared.pool = &pool;
+
+    // OpenCV's own threads would come on top of the budget.
+    int opencv_threads = getNumThreads();
+    setNumThreads(1);
+    pool.parallelFor((int) cameras.size(), [&](int i) {
+        results[i] = calibrateFleetCamera(cameras[i], shared);
+    });
+    setNumThreads(opencv_threads);
+
+    return results;
+}
+
+void saveFleetReport(const vector<FleetResult> &results, double seconds, const string &file) {
+    FileStorage fs(file, FileStorage::WRITE);
+    vector<double> errors;
+    double worst = 0;
+    fs << "cameras" << "[";
+    for (auto &result : results) {
+        fs << "{" << "data_dir" << result.camera.data_dir << "output" << result.camera.output
+           << "views" << result.views << "found" << result.found
+           << "detection_seconds" << result.detection_seconds
+           << "calibration_seconds" << result.calibration_seconds;
+        if (result.error.empty()) {
+            fs << "rms" << result.rms;
+            errors.push_back(result.rms);
+            worst = max(worst, result.rms);
+        } else {
+            fs << "error" << result.error;
+        }
+        fs << "}";
+    }
+    fs << "]";
+    fs << "calibrated" << (int) errors.size() << "failed" << (int) (results.size() - errors.size());
+    fs << "seconds" << seconds << "mean_rms" << meanRMS(errors) << "worst_rms" << worst;
+}
@@ -0,0 +1,65 @@
+#ifndef LAB2_FLEET_H
+#define LAB2_FLEET_H
+
+#include <string>
+#include <vector>
+#include "calibration.h"
+
+// A camera to calibrate in a batch.
+struct FleetCamera {
+    // Directory containing its .png calibration images.
+    std::string data_dir;
+    // Size of its checkerboard pattern (columns by rows), and of each square in meters.
+    cv::Size pattern_size;
+    float unit_size = 0;
+    // Where its calibration is saved.
+    std::string output;
+};
+
+// Outcome of the calibration of a camera of a batch.
+struct FleetResult {
+    FleetCamera camera;
+    // Images in the directory, and how many had all corners.
+    int views = 0;
+    int found = 0;
+    // Wall time of the corner detection and of the calibration.
+    double detection_seconds = 0;
+    double calibration_seconds = 0;
+    // RMS reprojection error of the calibration.
+    double rms = 0;
+    // Why the camera could not be calibrated, empty if it was.
+    std::string error;
+};
+
+/**
+ * Read a manifest of cameras. Each line holds, separated by spaces, the data directory, the columns and rows of the
+ * pattern, the size of its squares in meters and the output file. Empty lines and lines starting with # are skipped.
+ *
+ * @param file The manifest file.
+ * @return The cameras, in the order of the file.
+ * @throws invalid_argument if the file cannot be read or a line is malformed.
+ */
+std::vector<FleetCamera> readManifest(const std::string &file);
+
+/**
+ * Calibrate many cameras and save each calibration, with its undistortion maps. Cameras and their images share a
+ * single pool of threads: each worker takes a camera, and while it detects corners the other workers help with its
+ * images when they have no camera left, so the cores are never oversubscribed and stay busy until the last camera.
+ * A failing camera is reported and does not stop the others.
+ *
+ * @param cameras The cameras.
+ * @param detection How to search for the corners. Its threads are the budget for the whole batch, 0 uses all cores.
+ * @return One result per camera, in the same order.
+ */
+std::vector<FleetResult> calibrateFleet(const std::vector<FleetCamera> &cameras, const DetectionOptions &detection);
+
+/**
+ * Save the results of a batch, with their totals.
+ *
+ * @param results The results of calibrateFleet().
+ * @param seconds Wall time of the whole batch.
+ * @param file Destination file. Must have an extension supported by cv::FileStorage.
+ */
+void saveFleetReport(const std::vector<FleetResult> &results, double seconds, const std::string &file);
+
+#endif
@@ -3,7 +3,13 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/core/utils/filesystem.hpp>
 #include <iostream>
+#include <chrono>
 #include <iomanip>
+#include <stdexcept>
+#include "calibration.h"
+#include "corner_tracker.h"
+#include "fleet.h"
+#include "undistort_pipeline.h"
 
 using namespace std;
 using namespace cv;
@@ -17,84 +23,100 @@ static void show_usage(const string &name) {
               // Data directory option
               << "\t-d, --data DIR\t\tPath of the directory containing calibration .png images."
               << " Defaults to \"./lab2_data/checkerboard_images/\".\n"
+              // Video option
+              << "\t-v, --video FILE\tCalibrate from a video instead of the data directory. Corners are detected"
+              << " on keyframes only and tracked on the other frames. Cannot be used with --keep-going or"
+              << " --corners.\n"
+              << "\t-f, --frame-step N\tUse one video frame every N. Defaults to 5.\n"
               // Test file option
               << "\t-t, --test FILE\t\tPath of the file to then use as a test image."
               << " Defaults to \"./lab2_data/test_image.png\".\n"
               // Width and height of checkerboard pattern.
               << "\t-c, --columns WIDTH\tWidth (columns) of checkerboard pattern. Integer, defaults to 6.\n"
-              << "\t-r, --rows HEIGHT\tHeight (rows) of checkerboard pattern. Integer, defaults to 5."
+              << "\t-r, --rows HEIGHT\tHeight (rows) of checkerboard pattern. Integer, defaults to 5.\n"
+              // Detection options.
+              << "\t-s, --search SIZE\tLongest side of the downscaled images on which corners are searched first."
+              << " 0 searches at full resolution. Defaults to 1024.\n"
+              << "\t-j, --threads N\t\tThreads used to find corners. Defaults to 0 (all cores).\n"
+              // Fault tolerance options.
+              << "\t-k, --keep-going y|n\tIf \"y\", images where the corners are not found are reported and skipped"
+              << " instead of stopping the calibration. Defaults to \"n\".\n"
+              << "\t-n, --views N\t\tCalibrate on at most N views chosen to cover different poses, and validate"
+              << " on the others. Defaults to 0 (all views).\n"
+              << "\t-o, --corners FILE\tFile where found corners are saved. Images that did not change since the"
+              << " last run are not processed again. Defaults to none.\n"
+              // Persisted calibration.
+              << "\t-a, --calibration FILE\tFile with the camera calibration. If it exists the camera is loaded from"
+              << " it instead of being calibrated, otherwise the calibration is saved there. Defaults to none.\n"
+              // Headless undistortion.
+              << "\t-i, --increment DIR\tDirectory of new .png views used to refine the calibration loaded with"
+              << " --calibration, which is then saved again.\n"
+              << "\t-u, --undistort INPUT\tRectify a whole video or directory of images without showing anything,"
+              << " and report the frames per second. Requires --write.\n"
+              << "\t-w, --write OUTPUT\tWhere to write the rectified video, or directory for the rectified images.\n"
+              // Batch calibration.
+              << "\t-b, --batch MANIFEST\tCalibrate many cameras at once, sharing the threads given with --threads."
+              << " Each line of the manifest holds a data directory, pattern columns, rows, square size in meters and"
+              << " the output calibration file.\n"
+              << "\t-e, --report FILE\tWhere to save the timings and errors of a batch. Defaults to none."
               << std::endl;
 }
 
-// Just a structure to keep information about a camera in one place.
-struct CalibratedCamera {
-    // Intrinsics matrix.
-    Mat camera_matrix;
-    // Distortion coefficients.
-    vector<double> distortion_coefficients;
-};
-
-/**
- * @param files The set of filenames for the images.
- * @return A vector containing the images.
- */
-vector<Mat> getCheckerboardImages(const vector<string> &files);
-
 /**
- * @param checkerboard_images The images in which to find corners.
+ * Find the corners on the images of a directory, or on the frames of a video, calibrate the camera and print the
+ * results.
+ *
+ * @param data_dir Directory containing the .png calibration images.
+ * @param video Video to use instead of the directory, empty for none.
+ * @param tracking How to pick the frames of the video and track the corners between them.
  * @param pattern_size The size of the checkerboard pattern (columns by rows).
- * @return A vector with the coordinates of the corners on the images.
- * @throws invalid_argument if an image has missing corners.
- */
-vector<vector<Vec2f>> getImagePoints(const vector<Mat> &checkerboard_images, const Size &pattern_size);
-
-/**
- * @param n How many patterns are needed.
- * @param rows How many rows each pattern has.
- * @param columns How many columns each pattern has.
  * @param unit_size The size, in meters, of each square of the checkerboard.
- * @return A Vector of object points, essentially a vector of n identical vectors, each containing the same
- *         rows * columns points.
- */
-vector<vector<Vec3f>> getObjectPoints(int n, int rows, int columns, float unit_size);
-
-/**
- * Compute the reprojection error for an image.
- *
- * @param object_points The object points in the world reference frame.
- * @param pred_image_points The points found in the image.
- * @param rot The rotation vector between world frame and camera frame.
- * @param tra The translation vector between world frame and camera frame.
- * @param camera_matrix The 3 by 3 camera matrix for intrinsic params.
- * @param dist The distortion coefficients vectors.
- * @return The reprojection error for the given object.
+ * @param detection How to search for the corners.
+ * @param keep_going If true, images with missing corners are skipped, otherwise they stop the calibration.
+ * @param corners_file File where corners are cached between runs, empty for none.
+ * @param max_views How many views to calibrate on, the others are used for validation. 0 uses all views.
+ * @param show If true, an example of the found corners is shown in a window.
+ * @return The calibrated camera.
+ * @throws invalid_argument if an image has missing corners and keep_going is false.
  */
-double reprojectionError(
-        const vector<Vec3f> &object_points, const vector<Vec2f> &pred_image_points,
-        const Mat &rot, const Mat &tra, const Mat &camera_matrix, const vector<double> &dist
+CalibratedCamera calibrateFromData(
+        const string &data_dir, const string &video, const TrackingOptions &tracking,
+        const Size &pattern_size, float unit_size,
+        const DetectionOptions &detection, bool keep_going, const string &corners_file, int max_views, bool show
 );
 
 /**
- * Compute the mean RMS for a set of images.
- *
- * @param single_RMS The RMS for single images.
- */
-double meanRMS(const vector<double> &single_RMS);
-
-/**
+ * Refine a calibration with the views of a directory and print how much it changed.
  *
- * @param camera The camera information (intrinsics and distortion coefficients).
- * @param image The image to rectify.
- * @return An image obtained rectifying the input one with the parameters of the given camera.
+ * @param camera The camera, refined in place.
+ * @param increment_dir Directory containing the new .png views.
+ * @param pattern_size The size of the checkerboard pattern (columns by rows).
+ * @param unit_size The size, in meters, of each square of the checkerboard.
+ * @param detection How to search for the corners.
  */
-Mat undistortImage(const CalibratedCamera &camera, const Mat &image);
+void refineCalibration(
+        CalibratedCamera &camera, const string &increment_dir, const Size &pattern_size, float unit_size,
+        const DetectionOptions &detection
+);
 
 int main(int argc, char **argv) {
     // Default options.
     string DATA_DIR = "./lab2_data/checkerboard_images/";
+    string VIDEO;
+    TrackingOptions TRACKING;
     string TEST_IMG = "./lab2_data/test_image.png";
     Size PATTERN_SIZE = Size(6, 5);
     float UNIT = 0.11;
+    DetectionOptions DETECTION;
+    bool KEEP_GOING = false;
+    string CORNERS_FILE;
+    int MAX_VIEWS = 0;
+    string CALIBRATION_FILE;
+    string INCREMENT_DIR;
+    string UNDISTORT_INPUT;
+    string UNDISTORT_OUTPUT;
+    string MANIFEST;
+    string REPORT_FILE;
 
     // Command line arguments parsing ---
     if (argc > 1) {
@@ -117,6 +139,22 @@ int main(int argc, char **argv) {
                 }
                 // Skip next argument cause it is the directory.
                 DATA_DIR = argv[++i];
+            } else if ((arg == "-v") || (arg == "--video")) {
+                // No video -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the video.
+                VIDEO = argv[++i];
+            } else if ((arg == "-f") || (arg == "--frame-step")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the step.
+                TRACKING.frame_step = stoi(argv[++i]);
             } else if ((arg == "-t") || (arg == "--test")) {
                 // No test image -> error.
                 if (argv[i + 1] == nullptr) {
@@ -141,33 +179,268 @@ int main(int argc, char **argv) {
                 }
                 // Skip next argument cause it is the height.
                 PATTERN_SIZE = Size(PATTERN_SIZE.width, stoi(argv[++i]));
+            } else if ((arg == "-s") || (arg == "--search")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the size.
+                DETECTION.search_size = stoi(argv[++i]);
+            } else if ((arg == "-j") || (arg == "--threads")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the number of threads.
+                DETECTION.threads = stoi(argv[++i]);
+            } else if ((arg == "-k") || (arg == "--keep-going")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the choice.
+                KEEP_GOING = string(argv[++i]) == "y";
+            } else if ((arg == "-n") || (arg == "--views")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the number of views.
+                MAX_VIEWS = stoi(argv[++i]);
+            } else if ((arg == "-o") || (arg == "--corners")) {
+                // No file -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the file.
+                CORNERS_FILE = argv[++i];
+            } else if ((arg == "-a") || (arg == "--calibration")) {
+                // No file -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the file.
+                CALIBRATION_FILE = argv[++i];
+            } else if ((arg == "-i") || (arg == "--increment")) {
+                // No directory -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the directory.
+                INCREMENT_DIR = argv[++i];
+            } else if ((arg == "-u") || (arg == "--undistort")) {
+                // No input -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the input.
+                UNDISTORT_INPUT = argv[++i];
+            } else if ((arg == "-w") || (arg == "--write")) {
+                // No output -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the output.
+                UNDISTORT_OUTPUT = argv[++i];
+            } else if ((arg == "-b") || (arg == "--batch")) {
+                // No manifest -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the manifest.
+                MANIFEST = argv[++i];
+            } else if ((arg == "-e") || (arg == "--report")) {
+                // No file -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the file.
+                REPORT_FILE = argv[++i];
             }
         }
     }
 
-    // Find all png files and load them.
-    vector<string> checkerboard_files;
-    glob(DATA_DIR, "*.png", checkerboard_files);
-    vector<Mat> checkerboard_images = getCheckerboardImages(checkerboard_files);
+    // Calibrate a whole batch of cameras and stop there.
+    if (!MANIFEST.empty()) {
+        auto start = chrono::steady_clock::now();
+        vector<FleetResult> results = calibrateFleet(readManifest(MANIFEST), DETECTION);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        int failed = 0;
+        for (auto &result : results) {
+            if (result.error.empty()) {
+                cout << result.camera.data_dir << ": RMS " << result.rms << " from " << result.found << " of "
+                     << result.views << " views (" << result.detection_seconds << " s detection, "
+                     << result.calibration_seconds << " s calibration)." << endl;
+            } else {
+                cout << result.camera.data_dir << ": failed, " << result.error << endl;
+                failed++;
+            }
+        }
+        cout << "Calibrated " << results.size() - failed << " of " << results.size() << " cameras in "
+             << seconds << " s." << endl;
+        if (!REPORT_FILE.empty())
+            saveFleetReport(results, seconds, REPORT_FILE);
+        return failed > 0;
+    }
+
+    // Frames of a video always skip missing corners, and are never cached.
+    if (!VIDEO.empty() && (KEEP_GOING || !CORNERS_FILE.empty())) {
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    // Headless mode needs somewhere to write.
+    bool HEADLESS = !UNDISTORT_INPUT.empty();
+    if (HEADLESS && UNDISTORT_OUTPUT.empty()) {
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    // Load the camera if it was already calibrated, calibrate and save it otherwise.
+    CalibratedCamera camera;
+    if (!CALIBRATION_FILE.empty() && loadCamera(CALIBRATION_FILE, camera)) {
+        cout << "Loaded calibration from " << CALIBRATION_FILE << "." << endl;
+        if (!INCREMENT_DIR.empty()) {
+            refineCalibration(camera, INCREMENT_DIR, PATTERN_SIZE, UNIT, DETECTION);
+            saveCamera(camera, CALIBRATION_FILE);
+        }
+    } else {
+        camera = calibrateFromData(
+                DATA_DIR, VIDEO, TRACKING, PATTERN_SIZE, UNIT,
+                DETECTION, KEEP_GOING, CORNERS_FILE, MAX_VIEWS, !HEADLESS
+        );
+        if (!CALIBRATION_FILE.empty()) {
+            // Store the undistortion maps too, so the next runs can rectify right away.
+            prepareUndistortion(camera);
+            saveCamera(camera, CALIBRATION_FILE);
+        }
+    }
+
+    // Rectify a whole stream and stop there.
+    if (HEADLESS) {
+        PipelineReport report = undistortStream(camera, UNDISTORT_INPUT, UNDISTORT_OUTPUT, DETECTION.threads);
+        cout << "Rectified " << report.frames << " frames in " << report.seconds << " s ("
+             << report.fps << " fps)." << endl;
+        return 0;
+    }
+
+    // Rectify an image using the information of the calibrated camera.
+    Mat test_image = imread(TEST_IMG);
+    Mat rectified_image = undistortImage(camera, test_image);
+
+    // Show the result.
+    Mat comparison;
+    hconcat(test_image, rectified_image, comparison);
+    namedWindow("Result", WINDOW_NORMAL);
+    imshow("Result", comparison);
+    waitKey(0);
+
+    return 0;
+}
 
-    // Find checkerboard corners on the images.
-    vector<vector<Vec2f>> image_points = getImagePoints(checkerboard_images, PATTERN_SIZE);
+CalibratedCamera calibrateFromData(
+        const string &data_dir, const string &video, const TrackingOptions &tracking,
+        const Size &pattern_size, float unit_size,
+        const DetectionOptions &detection, bool keep_going, const string &corners_file, int max_views, bool show
+) {
+    vector<ViewDetection> views;
+    if (video.empty()) {
+        // Find all png files.
+        vector<string> all_files;
+        glob(data_dir, "*.png", all_files);
+
+        // Find checkerboard corners on the images.
+        views = detectViews(all_files, pattern_size, detection, corners_file);
+    } else {
+        // Find checkerboard corners on the video, tracking them between keyframes.
+        views = trackVideoViews(video, pattern_size, detection, tracking);
+        int tracked = 0;
+        for (auto &view : views)
+            tracked += view.tracked;
+        cout << "Tracked corners on " << tracked << " of " << views.size() << " frames." << endl;
+    }
+
+    // Keep the views where the corners were found, report the others.
+    vector<string> checkerboard_files;
+    vector<int> checkerboard_frames;
+    vector<vector<Vec2f>> image_points;
+    double detection_time = 0;
+    int reused = 0;
+    for (auto &view : views) {
+        string name = (view.frame < 0) ? view.file : view.file + " frame " + to_string(view.frame);
+        detection_time += view.cached ? 0 : view.seconds;
+        reused += view.cached;
+        if (view.found) {
+            checkerboard_files.push_back(name);
+            checkerboard_frames.push_back(view.frame);
+            image_points.push_back(view.corners);
+        } else {
+            cout << "Rejected " << name << ": corners not found." << endl;
+        }
+    }
+    cout << "Corners found on " << image_points.size() << " of " << views.size() << " images ("
+         << reused << " reused from earlier runs, " << detection_time << " s of detection)." << endl;
+    // Frames of a handheld video miss the pattern all the time, so they never stop the calibration.
+    if (image_points.size() < views.size() && !keep_going && video.empty())
+        throw invalid_argument("Image had missing corners.");
+    if (image_points.empty())
+        throw invalid_argument("No image had all corners.");
 
     // Show example of found corners.
     // Image 17 of the given dataset performs worst later, hence why I deem it an interesting example.
     // If another dataset is used, just take the last image.
-    int EXAMPLE_IMAGE = (16 > checkerboard_images.size() - 1) ? checkerboard_images.size() : 16;
-    Mat example_drawn = checkerboard_images[EXAMPLE_IMAGE].clone();
-    drawChessboardCorners(example_drawn, PATTERN_SIZE, image_points[EXAMPLE_IMAGE], true);
+    int EXAMPLE_IMAGE = (16 > checkerboard_files.size() - 1) ? (int) checkerboard_files.size() - 1 : 16;
+    Mat example_image = (checkerboard_frames[EXAMPLE_IMAGE] < 0)
+                        ? imread(checkerboard_files[EXAMPLE_IMAGE])
+                        : readFrame(video, checkerboard_frames[EXAMPLE_IMAGE]);
+    Mat example_drawn = example_image.clone();
+    drawChessboardCorners(example_drawn, pattern_size, image_points[EXAMPLE_IMAGE], true);
     resize(example_drawn, example_drawn, Size(560, 480));
-    namedWindow("Main");
-    imshow("Main", example_drawn);
+    if (show) {
+        namedWindow("Main");
+        imshow("Main", example_drawn);
+    }
+
+    Size size(example_image.cols, example_image.rows);
+
+    // Calibrate on a subset of views covering different poses, keep the others to validate the result.
+    vector<int> chosen = selectViews(image_points, pattern_size, size, max_views);
+    vector<string> validation_files;
+    vector<vector<Vec2f>> validation_points;
+    if (chosen.size() < image_points.size()) {
+        vector<string> chosen_files;
+        vector<vector<Vec2f>> chosen_points;
+        for (int i = 0, next = 0; i < image_points.size(); i++) {
+            if (next < chosen.size() && chosen[next] == i) {
+                chosen_files.push_back(checkerboard_files[i]);
+                chosen_points.push_back(move(image_points[i]));
+                next++;
+            } else {
+                validation_files.push_back(checkerboard_files[i]);
+                validation_points.push_back(move(image_points[i]));
+            }
+        }
+        checkerboard_files = move(chosen_files);
+        image_points = move(chosen_points);
+        cout << "Calibrating on " << image_points.size() << " views, validating on "
+             << validation_points.size() << "." << endl;
+    }
 
     // Calibrate camera.
     vector<vector<Vec3f>> object_points = getObjectPoints(
-            (int) image_points.size(), PATTERN_SIZE.height, PATTERN_SIZE.width, UNIT
+            (int) image_points.size(), pattern_size.height, pattern_size.width, unit_size
     );
-    Size size(checkerboard_images[0].cols, checkerboard_images[0].rows);
 
     Mat camera_matrix;
     vector<Mat> rot;
@@ -182,16 +455,10 @@ int main(int argc, char **argv) {
             errors, 0
     );
 
-    // Computing errors manually for assignment.
-    vector<double> manual_errors;
-    manual_errors.reserve(object_points.size());
-    for (int i = 0; i < object_points.size(); i++) {
-        manual_errors.push_back(reprojectionError(
-                object_points[i], image_points[i],
-                rot[i], tra[i], camera_matrix, dist
-        ));
-    }
-    double manual_mean_error = meanRMS(manual_errors);
+    // Computing errors manually for assignment, all views at once.
+    ReprojectionEvaluator evaluator(pattern_size.height, pattern_size.width, unit_size, detection.threads);
+    double manual_mean_error = evaluator.evaluate(image_points, rot, tra, camera_matrix, dist);
+    const vector<double> &manual_errors = evaluator.viewRMS();
 
     // Printing mean error, parameters, and camera matrix.
     cout << "Returned mean RMS: " << mean_error << endl;
@@ -231,109 +498,56 @@ int main(int argc, char **argv) {
     cout << "Worst performing image was: " << checkerboard_files[best_image_index]
          << " with error " << manual_errors[best_image_index] << endl;
 
-    // Rectify an image using the information of the calibrated camera.
-    CalibratedCamera camera = {camera_matrix, dist};
-    Mat test_image = imread(TEST_IMG);
-    Mat rectified_image = undistortImage(camera, test_image);
-
-    // Show the result.
-    Mat comparison;
-    hconcat(test_image, rectified_image, comparison);
-    namedWindow("Result", WINDOW_NORMAL);
-    imshow("Result", comparison);
-    waitKey(0);
-
-    return 0;
-}
-
-vector<Mat> getCheckerboardImages(const vector<string> &files) {
-    vector<Mat> images;
-    images.reserve(files.size());
-
-    // Load images.
-    for (auto &file : files)
-        images.push_back(imread(file));
-
-    return images;
-}
-
-vector<vector<Vec2f>> getImagePoints(const vector<Mat> &checkerboard_images, const Size &pattern_size) {
-    vector<vector<Vec2f>> image_points;
-    image_points.reserve(checkerboard_images.size());
-
-    for (auto &img: checkerboard_images) {
-        vector<Vec2f> corners;
-        bool res = findChessboardCorners(img, pattern_size, corners, 0);
-        // Raise error if no corners found.
-        if (!res)
-            throw invalid_argument("Image had missing corners.");
-        // Refine to sub-pixel precision.
-        Mat gray;
-        cvtColor(img, gray, COLOR_BGR2GRAY);
-        cornerSubPix(
-                gray, corners, Size(15, 15), Size(-1, -1),
-                TermCriteria(TermCriteria::EPS | TermCriteria::MAX_ITER, 30, 0.001)
+    // Check the calibration on the views it did not see, locating each of them with the found intrinsics.
+    if (!validation_points.empty()) {
+        vector<Mat> validation_rot(validation_points.size());
+        vector<Mat> validation_tra(validation_points.size());
+        const vector<Vec3f> &pattern = evaluator.pattern();
+        ThreadPool pool(detection.threads);
+        pool.parallelFor((int) validation_points.size(), [&](int i) {
+            solvePnP(pattern, validation_points[i], camera_matrix, dist, validation_rot[i], validation_tra[i]);
+        });
+        ReprojectionEvaluator validator(pattern_size.height, pattern_size.width, unit_size, detection.threads);
+        double validation_error = validator.evaluate(
+                validation_points, validation_rot, validation_tra, camera_matrix, dist
         );
-        image_points.push_back(corners);
+        const vector<double> &validation_errors = validator.viewRMS();
+        int worst_validation_index = (int) (
+                max_element(validation_errors.begin(), validation_errors.end()) - validation_errors.begin()
+        );
+        cout << "Validation mean RMS on " << validation_points.size() << " views: " << validation_error << endl;
+        cout << "Worst validation image was: " << validation_files[worst_validation_index]
+             << " with error " << validation_errors[worst_validation_index] << endl;
     }
 
-    return image_points;
-}
-
-vector<vector<Vec3f>> getObjectPoints(int n, int rows, int columns, float unit_size) {
-    vector<vector<Vec3f>> obj_points;
-
-    // Each pattern contains the same set of points, because all patterns are the same checkerboard.
-    for (int i = 0; i < n; i++) {
-        vector<Vec3f> patt;
-        for (int j = 0; j < rows; j++)
-            for (int k = 0; k < columns; k++)
-                patt.emplace_back(((float) j) * unit_size, ((float) k) * unit_size, 0);
-        obj_points.push_back(patt);
-    }
-    return obj_points;
+    CalibratedCamera camera = {camera_matrix, dist, size};
+    setCalibrationViews(camera, image_points);
+    return camera;
 }
 
-double reprojectionError(
-        const vector<Vec3f> &object_points, const vector<Vec2f> &pred_image_points,
-        const Mat &rot, const Mat &tra, const Mat &camera_matrix, const vector<double> &dist
+void refineCalibration(
+        CalibratedCamera &camera, const string &increment_dir, const Size &pattern_size, float unit_size,
+        const DetectionOptions &detection
 ) {
-    // Project the points and compute the distance with the predicted ones.
-    vector<Vec2f> image_points;
-    projectPoints(object_points, rot, tra, camera_matrix, dist, image_points);
-    return sqrt(norm(pred_image_points, image_points, NORM_L2SQR) / image_points.size());
-}
+    vector<string> files;
+    glob(increment_dir, "*.png", files);
+    vector<vector<Vec2f>> new_views;
+    for (auto &view : detectViews(files, pattern_size, detection, "")) {
+        if (view.found)
+            new_views.push_back(view.corners);
+        else
+            cout << "Rejected " << view.file << ": corners not found." << endl;
+    }
+    if (new_views.empty()) {
+        cout << "No new views to refine the calibration with." << endl;
+        return;
+    }
 
-double meanRMS(const vector<double> &single_RMS) {
-    vector<double> squared_RMS;
-    pow(single_RMS, 2, squared_RMS);
-    Scalar mean_RMS = mean(squared_RMS);
-    return sqrt(mean_RMS[0]);
+    RecalibrationReport report = recalibrate(camera, new_views, pattern_size, unit_size);
+    cout << "Refined calibration with " << new_views.size() << " new views (" << report.views << " in total) in "
+         << report.seconds << " s." << endl;
+    cout << "Mean RMS: " << report.rms << endl;
+    cout << "Change of {fx, fy, cx, cy}: {" << report.intrinsics_delta[0] << ", " << report.intrinsics_delta[1]
+         << ", " << report.intrinsics_delta[2] << ", " << report.intrinsics_delta[3] << "}, of distortion: "
+         << report.distortion_delta << "." << endl;
 }
-
-Mat undistortImage(const CalibratedCamera &camera, const Mat &image) {
-    Size original_size = Size(image.cols, image.rows);
-
-    // Get camera matrix for target image.
-    Rect roi;
-    Mat new_camera_matrix = getOptimalNewCameraMatrix(
-            camera.camera_matrix, camera.distortion_coefficients, original_size, 1, original_size, &roi
-    );
-
-    // Get maps from new camera matrix.
-    Mat map_x, map_y;
-    initUndistortRectifyMap(
-            camera.camera_matrix, camera.distortion_coefficients, Mat(),
-            new_camera_matrix, original_size, CV_32FC1, map_x, map_y
-    );
-
-    // Remap and crop.
-    Mat rectified;
-    remap(image, rectified, map_x, map_y, INTER_LINEAR);
-    rectified = rectified(roi);
-
-    // Resize image, since it has been cropped.
-    resize(rectified, rectified, original_size);
-
-    return rectified;
-}
\ No newline at end of file
@@ -2,6 +2,8 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include "filter.h"
+#include "memory_profiler.h"
+#include "preview_worker.h"
 
 using namespace std;
 using namespace cv;
@@ -13,13 +15,30 @@ static void show_usage(const string &name) {
               << "\t-h, --help\t\tShow this help message.\n"
               // Target image option
               << "\t-i, --image FILE\tPath to the image to use."
-              << " Defaults to \"./lab3_data/data/image.jpg\"."
+              << " Defaults to \"./lab3_data/data/image.jpg\".\n"
+              // Memory report
+              << "\t-m, --memory POOL_MB\tReport the memory used by each stage at exit. Freed buffers up to POOL_MB"
+              << " megabytes are reused, 0 disables the pool.\n"
+              // Recursive gaussian
+              << "\t-r, --recursive y|n\tIf \"y\", the gaussian filter is approximated with a recursive filter whose"
+              << " cost does not depend on sigma. Defaults to \"n\".\n"
+              // Tiled execution
+              << "\t-x, --tiles SIZE\tRun the filters on tiles of SIZE pixels, in parallel, so that a slider moved"
+              << " again stops the work in progress. 0 filters whole images. Defaults to 512.\n"
+              // Result cache
+              << "\t-c, --cache MB\t\tKeep up to MB megabytes of filtered images, so that a slider moved back to a"
+              << " previous value shows its image right away. 0 disables the cache. Defaults to 256.\n"
+              // Bilateral grid
+              << "\t-g, --grid SCALE\tApproximate the bilateral filter with a grid whose cells are SCALE sigmas wide."
+              << " Press e to print its error against the exact filter. Defaults to 0 (exact filter)."
               << std::endl;
 }
 
 struct Userdata {
     Mat &current_image;
     Filter &filter;
+    // Filters the image in the background.
+    PreviewWorker &preview;
 };
 
 // Apparently in C++ constants are a bad practice according to CLion. This seems to be a suitable workaround to make
@@ -120,6 +139,10 @@ void bilateral_space_update(int param, void *userdata);
 int main(int argc, char **argv) {
     // Load image and equalize it.
     string IMAGE_PATH = "./lab3_data/data/image.jpg";
+    double GRID_SCALE = 0;
+    bool RECURSIVE = false;
+    int TILE_SIZE = 512;
+    int CACHE_MB = 256;
 
     // Command line arguments parsing ---
     if (argc > 1) {
@@ -142,6 +165,46 @@ int main(int argc, char **argv) {
                 }
                 // Skip next argument cause it is the directory.
                 IMAGE_PATH = argv[++i];
+            } else if ((arg == "-m") || (arg == "--memory")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Install the profiler before any image is loaded.
+                MemoryProfiler::install((size_t) stoi(argv[++i]) * 1048576);
+            } else if ((arg == "-g") || (arg == "--grid")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the scale.
+                GRID_SCALE = stod(argv[++i]);
+            } else if ((arg == "-r") || (arg == "--recursive")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the choice.
+                RECURSIVE = string(argv[++i]) == "y";
+            } else if ((arg == "-x") || (arg == "--tiles")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the size.
+                TILE_SIZE = stoi(argv[++i]);
+            } else if ((arg == "-c") || (arg == "--cache")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the size.
+                CACHE_MB = stoi(argv[++i]);
             }
         }
     }
@@ -163,11 +226,17 @@ int main(int argc, char **argv) {
     // Compute which image was clicked based on x coordinate.
     Mat playground_image = images[x * 3 / getWindowImageRect(comparison_window).width];
 
+    // Shared by all windows. The sliders only post requests to it, the images are shown as they are ready.
+    FilterCache cache((size_t) CACHE_MB * 1048576);
+    PreviewWorker preview(TILE_SIZE, 512, CACHE_MB > 0 ? &cache : nullptr);
+
     // Window to observe Gaussian Filter.
     string gauss_win = GAUSS_WIN();
     GaussianFilter gauss_filter(5, 1);
+    if (RECURSIVE)
+        gauss_filter.setMode(GaussianFilter::RECURSIVE);
     namedWindow(gauss_win, WINDOW_NORMAL);
-    struct Userdata gauss_userdata = {playground_image, gauss_filter};
+    struct Userdata gauss_userdata = {playground_image, gauss_filter, preview};
     createTrackbar("gauss_sigma", gauss_win, nullptr, 40, gauss_sigma_update, (void *) &gauss_userdata);
     createTrackbar("gauss_size", gauss_win, nullptr, 40, gauss_size_update, (void *) &gauss_userdata);
     imshow(gauss_win, playground_image);
@@ -176,20 +245,35 @@ int main(int argc, char **argv) {
     string median_win = MEDIAN_WIN();
     MedianFilter median_filter(5);
     namedWindow(median_win, WINDOW_NORMAL);
-    struct Userdata median_userdata = {playground_image, median_filter};
+    struct Userdata median_userdata = {playground_image, median_filter, preview};
     createTrackbar("median_size", median_win, nullptr, 40, median_size_update, (void *) &median_userdata);
     imshow(median_win, playground_image);
 
     // Window to observe Bilateral Filter.
     string bilateral_win = BILATERAL_WIN();
     BilateralFilter bilateral_filter(5, 1, 1);
+    if (GRID_SCALE > 0) {
+        bilateral_filter.setMode(BilateralFilter::GRID);
+        bilateral_filter.setGridScale(GRID_SCALE);
+    }
     namedWindow(bilateral_win, WINDOW_NORMAL);
-    struct Userdata bilateral_userdata = {playground_image, bilateral_filter};
+    struct Userdata bilateral_userdata = {playground_image, bilateral_filter, preview};
     createTrackbar("bilateral_range", bilateral_win, nullptr, 40, bilateral_range_update, (void *) &bilateral_userdata);
     createTrackbar("bilateral_space", bilateral_win, nullptr, 40, bilateral_space_update, (void *) &bilateral_userdata);
     imshow(bilateral_win, playground_image);
 
-    waitKey(0);
+    // Any key quits, except e in grid mode which prints the error of the approximation.
+    while (true) {
+        int key = waitKey(15);
+        preview.show();
+        if (key < 0)
+            continue;
+        if (key != 'e' || GRID_SCALE <= 0)
+            break;
+        cout << "Bilateral grid RMS error: " << bilateral_filter.exactError(playground_image) << endl;
+    }
+    if (CACHE_MB > 0)
+        cout << "Filter cache: " << cache.hits() << " hits, " << cache.misses() << " misses" << endl;
     return 0;
 }
 
@@ -237,6 +321,8 @@ vector<Mat> getHistogramsBGR(const Mat &image) {
 }
 
 void equalizeAndShowBGR(Mat &image, Mat &output) {
+    MemoryScope scope("equalization");
+
     // Split the image into the BGR planes.
     vector<Mat> bgr_planes;
     split(image, bgr_planes);
@@ -260,6 +346,8 @@ void equalizeAndShowBGR(Mat &image, Mat &output) {
 }
 
 void equalizeAndShowHSV(Mat &image, Mat &output) {
+    MemoryScope scope("equalization");
+
     // Split the image into the HSV planes.
     Mat hsv_image;
     vector<Mat> hsv_planes;
@@ -329,65 +417,40 @@ void selectImage(int event, int x, int y, int flags, void *userdata) {
 
 void gauss_sigma_update(int param, void *userdata) {
     auto &filter = (GaussianFilter &) ((Userdata *) userdata)->filter;
-    auto &image = ((Userdata *) userdata)->current_image;
-    Mat output;
 
-    // Filter image.
+    // Filter image in the background, it is shown once ready.
     filter.setSigma(param);
-    filter.apply(image, output);
-
-    // Show image.
-    imshow(GAUSS_WIN(), output);
+    ((Userdata *) userdata)->preview.post(GAUSS_WIN(), ((Userdata *) userdata)->current_image, filter);
 }
 
 void gauss_size_update(int param, void *userdata) {
     auto &filter = (GaussianFilter &) ((Userdata *) userdata)->filter;
-    auto &image = ((Userdata *) userdata)->current_image;
-    Mat output;
 
-    // Filter image.
+    // Filter image in the background, it is shown once ready.
     filter.setSize(param);
-    filter.apply(image, output);
-
-    // Show image.
-    imshow(GAUSS_WIN(), output);
+    ((Userdata *) userdata)->preview.post(GAUSS_WIN(), ((Userdata *) userdata)->current_image, filter);
 }
 
 void median_size_update(int param, void *userdata) {
     auto &filter = (MedianFilter &) ((Userdata *) userdata)->filter;
-    auto &image = ((Userdata *) userdata)->current_image;
-    Mat output;
 
-    // Filter image.
+    // Filter image in the background, it is shown once ready.
     filter.setSize(param);
-    filter.apply(image, output);
-
-    // Show image.
-    imshow(MEDIAN_WIN(), output);
+    ((Userdata *) userdata)->preview.post(MEDIAN_WIN(), ((Userdata *) userdata)->current_image, filter);
 }
 
 void bilateral_range_update(int param, void *userdata) {
     auto &filter = (BilateralFilter &) ((Userdata *) userdata)->filter;
-    auto &image = ((Userdata *) userdata)->current_image;
-    Mat output;
 
-    // Filter image.
+    // Filter image in the background, it is shown once ready.
     filter.setSigmaRange(param);
-    filter.apply(image, output);
-
-    // Show image.
-    imshow(BILATERAL_WIN(), output);
+    ((Userdata *) userdata)->preview.post(BILATERAL_WIN(), ((Userdata *) userdata)->current_image, filter);
 }
 
 void bilateral_space_update(int param, void *userdata) {
     auto &filter = (BilateralFilter &) ((Userdata *) userdata)->filter;
-    auto &image = ((Userdata *) userdata)->current_image;
-    Mat output;
 
-    // Filter image.
+    // Filter image in the background, it is shown once ready.
     filter.setSigmaSpace(param);
-    filter.apply(image, output);
-
-    // Show image.
-    imshow(BILATERAL_WIN(), output);
+    ((Userdata *) userdata)->preview.post(BILATERAL_WIN(), ((Userdata *) userdata)->current_image, filter);
 }
\ No newline at end of file
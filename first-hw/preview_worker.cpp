@@ -0,0 +1,180 @@
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <exception>
+#include <iostream>
+#include <utility>
+#include "memory_profiler.h"
+#include "preview_worker.h"
+
+PreviewWorker::PreviewWorker(int tile_size, int preview_size, FilterCache *cache) :
+        preview_size(preview_size), cache(cache) {
+    if (tile_size > 0)
+        executor.reset(new TiledExecutor(tile_size));
+    worker = std::thread(&PreviewWorker::work, this);
+}
+
+PreviewWorker::~PreviewWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    worker.join();
+}
+
+// Most images kept for reuse as outputs.
+static const size_t MAX_SPARE = 4;
+
+void PreviewWorker::post(
+        const std::string &window, const cv::Mat &image, std::unique_ptr<Filter> parameters, Assign assign
+) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Replaces the request of the window if it has not started, and makes it stale if it has.
+        Request &request = pending[window];
+        request.image = image;
+        request.parameters = std::move(parameters);
+        request.assign = std::move(assign);
+        request.generation = ++generations[window];
+    }
+    available.notify_one();
+}
+
+void PreviewWorker::show() {
+    std::map<std::string, Result> results;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        results.swap(ready);
+        // A request may have come after the result was published.
+        for (auto it = results.begin(); it != results.end();) {
+            if (it->second.generation != generations[it->first]) {
+                recycle(it->second.image);
+                it = results.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    for (auto &result : results)
+        cv::imshow(result.first, result.second.image);
+
+    // The windows keep their own copy.
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &result : results)
+        recycle(result.second.image);
+}
+
+void PreviewWorker::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        available.wait(lock, [this] { return stopping || !pending.empty(); });
+        if (stopping)
+            return;
+
+        std::string window = pending.begin()->first;
+        Request request = std::move(pending.begin()->second);
+        pending.erase(pending.begin());
+
+        lock.unlock();
+        try {
+            render(window, request);
+        } catch (const std::exception &e) {
+            // Nobody waits on this thread, the window just keeps its last image.
+            std::cerr << window << ": " << e.what() << std::endl;
+        }
+        lock.lock();
+    }
+}
+
+void PreviewWorker::render(const std::string &window, Request &request) {
+    auto cancelled = [&] { return stale(window, request.generation); };
+    KeptFilters &kept = filters[window];
+    request.assign(kept.filter, *request.parameters);
+    Filter &filter = *kept.filter;
+
+    // Receives the cached image if any, the full resolution one otherwise.
+    cv::Mat output = takeSpare(request.image.size(), request.image.type());
+    std::string key;
+    if (cache) {
+        // The image rarely changes between requests, hash it only when it does.
+        if (hashed_source.data != request.image.data || hashed_source.size() != request.image.size()) {
+            hashed_key = cache->imageKey(request.image);
+            hashed_source = request.image;
+        }
+        key = cache->key(filter, hashed_key);
+        if (cache->find(key, output)) {
+            publish(window, request.generation, output);
+            return;
+        }
+    }
+
+    double scale = (double) preview_size / std::max(request.image.cols, request.image.rows);
+
+    if (scale < 1) {
+        MemoryScope scope("preview");
+        // The image rarely changes between requests, only the filter does.
+        if (preview_source.data != request.image.data || preview_source.size() != request.image.size()) {
+            cv::resize(request.image, preview_image, cv::Size(), scale, scale, cv::INTER_AREA);
+            preview_source = request.image;
+        }
+        cv::Mat preview = takeSpare(request.image.size(), request.image.type());
+        request.assign(kept.preview, *request.parameters);
+        kept.preview->rescale(scale);
+        kept.preview->apply(preview_image, preview_filtered);
+        // Same size as the final image, so the window does not change size when it comes.
+        cv::resize(preview_filtered, preview, request.image.size(), 0, 0, cv::INTER_LINEAR);
+        publish(window, request.generation, preview);
+    }
+    if (cancelled())
+        return;
+
+    MemoryScope scope("filtering");
+    if (executor && filter.getRadius() >= 0) {
+        output.create(request.image.size(), request.image.type());
+        MatTileSource source(request.image);
+        MatTileSink sink(output);
+        if (!executor->apply(filter, source, sink, cancelled))
+            return;
+    } else {
+        filter.apply(request.image, output);
+    }
+    if (cache)
+        cache->insert(key, output);
+    publish(window, request.generation, output);
+}
+
+bool PreviewWorker::stale(const std::string &window, unsigned long generation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stopping || generations[window] != generation;
+}
+
+void PreviewWorker::publish(const std::string &window, unsigned long generation, const cv::Mat &image) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping || generations[window] != generation)
+        return;
+    // A preview not shown yet is replaced by the final image.
+    auto it = ready.find(window);
+    if (it != ready.end())
+        recycle(it->second.image);
+    ready[window] = {image, generation};
+}
+
+cv::Mat PreviewWorker::takeSpare(const cv::Size &size, int type) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto it = spare.begin(); it != spare.end(); ++it) {
+        if (it->size() == size && it->type() == type) {
+            cv::Mat image = *it;
+            spare.erase(it);
+            return image;
+        }
+    }
+    return cv::Mat();
+}
+
+void PreviewWorker::recycle(cv::Mat &image) {
+    // Only images nobody else points to, or their pixels would change under them.
+    if (spare.size() < MAX_SPARE && image.u && image.u->refcount == 1)
+        spare.push_back(image);
+    image.release();
+}
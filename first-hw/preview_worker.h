@@ -0,0 +1,163 @@
+#ifndef LAB3_PREVIEW_WORKER_H
+#define LAB3_PREVIEW_WORKER_H
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <opencv2/core.hpp>
+#include "filter.h"
+#include "tiled_executor.h"
+
+/**
+ * Filter images for windows on a background thread, so that the UI thread never waits for a filter.
+ * Each request first renders a downscaled copy of the image, with the filter rescaled to match (see
+ * Filter::rescale()), and then the full resolution image. Only the latest request of each window counts: a newer one
+ * replaces it if it has not started, and makes it stop between tiles if it has. Results are shown by the UI thread in
+ * show(), and only if no newer request came in the meantime, so a window never goes back to older parameters.
+ * With a cache, requests seen before skip the preview and show the kept full resolution image right away.
+ * The worker keeps a filter per window and per resolution, and copies the parameters of each request into it, so the
+ * scratch buffers of the filters (see FilterScratch) are reused from one request to the next. Images already shown
+ * are reused as outputs too.
+ */
+class PreviewWorker {
+
+public:
+
+    /**
+     * @param tile_size Side of the tiles full resolution images are filtered on, in parallel. Stale requests stop
+     * between tiles. 0 filters whole images, which stop only after the preview.
+     * @param preview_size Longest side of the preview. Smaller images are filtered at full resolution only.
+     * @param cache Where full resolution images are kept, if set. Must outlive the worker.
+     */
+    explicit PreviewWorker(int tile_size = 512, int preview_size = 512, FilterCache *cache = nullptr);
+
+    /**
+     * Drops the pending requests and waits for the running one to stop.
+     */
+    ~PreviewWorker();
+
+    PreviewWorker(const PreviewWorker &) = delete;
+
+    PreviewWorker &operator=(const PreviewWorker &) = delete;
+
+    /**
+     * Request a filtered image for a window. The filter is copied, so it can be changed right after.
+     * @param window The window.
+     * @param image The image to filter. Must not be modified while the request runs. With a cache, images are told
+     * apart by their address, so a modified image must be posted as a new cv::Mat.
+     * @param filter The filter.
+     */
+    template<class F>
+    void post(const std::string &window, const cv::Mat &image, const F &filter) {
+        // The copy has no buffers, it only carries the parameters to the filters kept by the worker.
+        Assign assign = [](std::unique_ptr<Filter> &kept, const Filter &parameters) {
+            F *same = dynamic_cast<F *>(kept.get());
+            if (same)
+                *same = (const F &) parameters;
+            else
+                kept.reset(new F((const F &) parameters));
+        };
+        post(window, image, std::unique_ptr<Filter>(new F(filter)), assign);
+    }
+
+    /**
+     * Show the results completed since the last call. Must be called from the thread owning the windows, e.g.
+     * between calls to cv::waitKey().
+     */
+    void show();
+
+protected:
+
+    // Copies the parameters of a request into a kept filter, creating it if it is missing or of another type.
+    typedef std::function<void(std::unique_ptr<Filter> &, const Filter &)> Assign;
+
+    // A request, with a copy of the filter holding its parameters.
+    struct Request {
+        cv::Mat image;
+        std::unique_ptr<Filter> parameters;
+        Assign assign;
+        unsigned long generation;
+    };
+
+    // The filters kept for a window, at full resolution and for the preview.
+    struct KeptFilters {
+        std::unique_ptr<Filter> filter;
+        std::unique_ptr<Filter> preview;
+    };
+
+    // A filtered image waiting to be shown.
+    struct Result {
+        cv::Mat image;
+        unsigned long generation;
+    };
+
+    int preview_size;
+    std::unique_ptr<TiledExecutor> executor;
+    FilterCache *cache;
+
+    // Latest generation of each window, its request if it has not started, and its results not shown yet.
+    std::map<std::string, unsigned long> generations;
+    std::map<std::string, Request> pending;
+    std::map<std::string, Result> ready;
+    // Images shown or dropped, reused as outputs.
+    std::vector<cv::Mat> spare;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    // Filters of each window. Only used by the worker thread.
+    std::map<std::string, KeptFilters> filters;
+
+    // Last image hashed for the cache, and its key. Only used by the worker thread.
+    cv::Mat hashed_source;
+    std::string hashed_key;
+
+    // Last image downscaled, its preview, and the filtered preview. Only used by the worker thread.
+    cv::Mat preview_source;
+    cv::Mat preview_image;
+    cv::Mat preview_filtered;
+
+    std::thread worker;
+
+    void post(const std::string &window, const cv::Mat &image, std::unique_ptr<Filter> parameters, Assign assign);
+
+    /**
+     * Run the requests until stopped.
+     */
+    void work();
+
+    /**
+     * Render a request, preview first.
+     * @param window The window.
+     * @param request The request.
+     */
+    void render(const std::string &window, Request &request);
+
+    /**
+     * @return Whether a newer request came for the window, or the worker is stopping.
+     */
+    bool stale(const std::string &window, unsigned long generation);
+
+    /**
+     * Queue a result for show(), unless it is stale.
+     */
+    void publish(const std::string &window, unsigned long generation, const cv::Mat &image);
+
+    /**
+     * @return A spare image of the given size and type, or an empty one.
+     */
+    cv::Mat takeSpare(const cv::Size &size, int type);
+
+    /**
+     * Keep images no longer referenced anywhere else for takeSpare(). Call with the mutex held.
+     */
+    void recycle(cv::Mat &image);
+
+};
+
+#endif
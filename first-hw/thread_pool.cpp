@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include "thread_pool.h"
+
+ThreadPool::ThreadPool(int threads) {
+    if (threads <= 0)
+        threads = (int) std::max(1u, std::thread::hardware_concurrency());
+    this->threads = threads;
+
+    // The caller of parallelFor() works too, so one thread less is needed.
+    for (int i = 0; i < threads - 1; i++)
+        workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+int ThreadPool::size() const {
+    return threads;
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)> &body) {
+    if (n <= 0)
+        return;
+
+    // Shared with the helper tasks, which may start after this call has returned and find nothing left to do.
+    struct State {
+        std::atomic<int> next{0};
+        int completed = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto state = std::make_shared<State>();
+    const std::function<void(int)> *work = &body;
+
+    // Claim indices until there are none left. The body is only used while some index is not completed.
+    auto run = [state, work, n]() {
+        for (int i = state->next++; i < n; i = state->next++) {
+            std::exception_ptr error;
+            try {
+                (*work)(i);
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (error && !state->error)
+                state->error = error;
+            if (++state->completed == n)
+                state->done.notify_all();
+        }
+    };
+
+    int helpers = std::min(n, threads) - 1;
+    for (int i = 0; i < helpers; i++)
+        submit(run);
+    run();
+
+    // Wait for indices claimed by other threads. Waiting on indices rather than on tasks avoids deadlocks when every
+    // worker is itself inside a parallelFor().
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->done.wait(lock, [&state, n]() { return state->completed == n; });
+    if (state->error)
+        std::rethrow_exception(state->error);
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    available.notify_one();
+}
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            available.wait(lock, [this]() { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef LAB_THREAD_POOL_H
+#define LAB_THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed size pool of worker threads.
+ */
+class ThreadPool {
+
+public:
+
+    /**
+     * @param threads How many threads run work, counting the thread calling parallelFor(). 0 uses all cores.
+     */
+    explicit ThreadPool(int threads = 0);
+
+    /**
+     * Waits for the queued tasks to finish.
+     */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    /**
+     * @return How many threads run work, counting the calling thread.
+     */
+    int size() const;
+
+    /**
+     * Run body(i) for each i in [0, n) and wait for all of them. Indices are claimed one at a time by whichever thread
+     * is free, the calling thread included, so uneven work is balanced. Can be called from inside a task.
+     * @param n How many indices.
+     * @param body The work for a single index.
+     * @throws The first exception thrown by body, once all indices are done.
+     */
+    void parallelFor(int n, const std::function<void(int)> &body);
+
+    /**
+     * Queue a task to run on a worker thread.
+     * @param task The task. Exceptions are not caught.
+     */
+    void submit(std::function<void()> task);
+
+private:
+
+    int threads;
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable available;
+    bool stopping = false;
+
+    /**
+     * Loop of each worker thread.
+     */
+    void work();
+
+};
+
+#endif
@@ -0,0 +1,141 @@
+#include <atomic>
+#include <stdexcept>
+#include "tiled_executor.h"
+
+MatTileSource::MatTileSource(const cv::Mat &image) : image(image) {}
+
+cv::Size MatTileSource::size() const {
+    return image.size();
+}
+
+int MatTileSource::type() const {
+    return image.type();
+}
+
+void MatTileSource::read(const cv::Rect &region, cv::Mat &tile) {
+    // A header of the exact size rather than a ROI, so filters cannot see around it.
+    tile = cv::Mat(region.height, region.width, image.type(), (void *) image.ptr(region.y, region.x), image.step);
+}
+
+MatTileSink::MatTileSink(cv::Mat &image) : image(image) {}
+
+void MatTileSink::write(const cv::Rect &region, const cv::Mat &tile) {
+    tile.copyTo(image(region));
+}
+
+RawFileTileSource::RawFileTileSource(const std::string &file, const cv::Size &size, int type) :
+        stream(file, std::ios::binary), image_size(size), image_type(type) {
+    if (!stream)
+        throw std::invalid_argument("Cannot open " + file + ".");
+}
+
+cv::Size RawFileTileSource::size() const {
+    return image_size;
+}
+
+int RawFileTileSource::type() const {
+    return image_type;
+}
+
+void RawFileTileSource::read(const cv::Rect &region, cv::Mat &tile) {
+    tile.create(region.height, region.width, image_type);
+    size_t element_size = tile.elemSize();
+    std::streamsize row_bytes = (std::streamsize) (region.width * element_size);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int y = 0; y < region.height; y++) {
+        stream.seekg((std::streamoff) (((size_t) (region.y + y) * image_size.width + region.x) * element_size));
+        stream.read((char *) tile.ptr(y), row_bytes);
+        if (stream.fail() || stream.gcount() != row_bytes) {
+            // Clear the error, or every later read would fail too.
+            stream.clear();
+            throw std::invalid_argument("Cannot read row " + std::to_string(region.y + y) + ", the file is too short.");
+        }
+    }
+}
+
+RawFileTileSink::RawFileTileSink(const std::string &file, const cv::Size &size, int type) :
+        image_size(size), element_size(CV_ELEM_SIZE(type)) {
+    // Create the file, then reopen it to write anywhere in it.
+    {
+        std::ofstream create(file, std::ios::binary | std::ios::trunc);
+    }
+    stream.open(file, std::ios::binary | std::ios::in | std::ios::out);
+    if (!stream)
+        throw std::invalid_argument("Cannot create " + file + ".");
+    // Write the last byte, so the file has the size of the whole image even if some tiles are never written.
+    size_t total = (size_t) size.area() * element_size;
+    if (total > 0) {
+        stream.seekp((std::streamoff) (total - 1));
+        stream.put('\0');
+        stream.flush();
+        if (stream.fail())
+            throw std::invalid_argument("Cannot create " + file + ".");
+    }
+}
+
+void RawFileTileSink::write(const cv::Rect &region, const cv::Mat &tile) {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int y = 0; y < region.height; y++) {
+        stream.seekp((std::streamoff) (((size_t) (region.y + y) * image_size.width + region.x) * element_size));
+        stream.write((const char *) tile.ptr(y), (std::streamsize) (region.width * element_size));
+        if (stream.fail()) {
+            stream.clear();
+            throw std::invalid_argument("Cannot write row " + std::to_string(region.y + y) + ".");
+        }
+    }
+}
+
+TiledExecutor::TiledExecutor(int tile_size) : tile_size(tile_size) {
+    CV_Assert(tile_size > 0);
+}
+
+void TiledExecutor::apply(Filter &filter, const cv::Mat &image, cv::Mat &output) {
+    if (filter.getRadius() < 0) {
+        filter.apply(image, output);
+        return;
+    }
+
+    // Tiles are written as soon as they are done, so the output cannot be the input.
+    cv::Mat source = (output.data == image.data) ? image.clone() : image;
+    output.create(image.size(), image.type());
+    MatTileSource tiles(source);
+    MatTileSink sink(output);
+    apply(filter, tiles, sink);
+}
+
+bool TiledExecutor::apply(
+        Filter &filter, TileSource &source, TileSink &sink, const std::function<bool()> &cancelled
+) {
+    int radius = filter.getRadius();
+    if (radius < 0)
+        throw std::invalid_argument("The filter needs the whole image, it cannot run on tiles.");
+
+    cv::Size size = source.size();
+    int columns = (size.width + tile_size - 1) / tile_size;
+    int rows = (size.height + tile_size - 1) / tile_size;
+    std::atomic<bool> stopped(false);
+
+    // One stripe per tile, so free threads take the next tile. The filters' own parallel loops run serially inside.
+    int tiles = columns * rows;
+    cv::parallel_for_(cv::Range(0, tiles), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++) {
+            if (stopped || (cancelled && cancelled())) {
+                stopped = true;
+                return;
+            }
+
+            cv::Rect core((i % columns) * tile_size, (i / columns) * tile_size, tile_size, tile_size);
+            core &= cv::Rect(cv::Point(), size);
+            cv::Rect margin(core.x - radius, core.y - radius, core.width + 2 * radius, core.height + 2 * radius);
+            margin &= cv::Rect(cv::Point(), size);
+
+            cv::Mat input;
+            cv::Mat output;
+            source.read(margin, input);
+            filter.apply(input, output);
+            sink.write(core, output(core - margin.tl()));
+        }
+    }, tiles);
+
+    return !stopped;
+}
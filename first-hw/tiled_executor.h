@@ -0,0 +1,205 @@
+#ifndef LAB3_TILED_EXECUTOR_H
+#define LAB3_TILED_EXECUTOR_H
+
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <opencv2/core.hpp>
+#include "filter.h"
+
+/**
+ * Where the tiles of an image are read from.
+ */
+class TileSource {
+
+public:
+
+    virtual ~TileSource() = default;
+
+    /**
+     * @return The size of the whole image.
+     */
+    virtual cv::Size size() const = 0;
+
+    /**
+     * @return The OpenCV type of the image.
+     */
+    virtual int type() const = 0;
+
+    /**
+     * Read a region. Called from many threads at once.
+     * @param region The region, inside the image.
+     * @param tile Destination for the pixels. Must not be a view of a bigger image.
+     */
+    virtual void read(const cv::Rect &region, cv::Mat &tile) = 0;
+
+};
+
+/**
+ * Where the tiles of an image are written to.
+ */
+class TileSink {
+
+public:
+
+    virtual ~TileSink() = default;
+
+    /**
+     * Write a region. Called from many threads at once, regions never overlap.
+     * @param region The region, inside the image.
+     * @param tile The pixels.
+     */
+    virtual void write(const cv::Rect &region, const cv::Mat &tile) = 0;
+
+};
+
+/**
+ * Tiles of an image in memory.
+ */
+class MatTileSource : public TileSource {
+
+public:
+
+    explicit MatTileSource(const cv::Mat &image);
+
+    cv::Size size() const override;
+
+    int type() const override;
+
+    void read(const cv::Rect &region, cv::Mat &tile) override;
+
+protected:
+
+    cv::Mat image;
+
+};
+
+/**
+ * Tiles written to an image in memory.
+ */
+class MatTileSink : public TileSink {
+
+public:
+
+    /**
+     * @param image The image, already allocated with the right size and type.
+     */
+    explicit MatTileSink(cv::Mat &image);
+
+    void write(const cv::Rect &region, const cv::Mat &tile) override;
+
+protected:
+
+    cv::Mat image;
+
+};
+
+/**
+ * Tiles of an image stored in a file as raw pixels, row after row with no header, so that it never has to fit in
+ * memory. The file is accessed by one thread at a time.
+ */
+class RawFileTileSource : public TileSource {
+
+public:
+
+    /**
+     * @param file The file.
+     * @param size The size of the image.
+     * @param type The OpenCV type of the pixels.
+     * @throws invalid_argument if the file cannot be opened.
+     */
+    RawFileTileSource(const std::string &file, const cv::Size &size, int type);
+
+    cv::Size size() const override;
+
+    int type() const override;
+
+    /**
+     * @throws invalid_argument if the file ends before the region.
+     */
+    void read(const cv::Rect &region, cv::Mat &tile) override;
+
+protected:
+
+    std::ifstream stream;
+    cv::Size image_size;
+    int image_type;
+    std::mutex mutex;
+
+};
+
+/**
+ * Tiles written to a raw file, in the same format read by RawFileTileSource. The file is created with the size of the
+ * whole image.
+ */
+class RawFileTileSink : public TileSink {
+
+public:
+
+    /**
+     * @param file The file, overwritten.
+     * @param size The size of the image.
+     * @param type The OpenCV type of the pixels.
+     * @throws invalid_argument if the file cannot be created.
+     */
+    RawFileTileSink(const std::string &file, const cv::Size &size, int type);
+
+    /**
+     * @throws invalid_argument if the region cannot be written, e.g. with a full disk.
+     */
+    void write(const cv::Rect &region, const cv::Mat &tile) override;
+
+protected:
+
+    std::fstream stream;
+    cv::Size image_size;
+    size_t element_size;
+    std::mutex mutex;
+
+};
+
+/**
+ * Run a filter on square tiles of an image, in parallel. Each tile is read with a margin as wide as the radius of the
+ * filter (see Filter::getRadius()) and is passed to the filter as an image of its own, so the filter handles the image
+ * borders as usual and the output matches the one of the whole image. Tiles run on OpenCV's threads (see
+ * cv::setNumThreads()) and are claimed by whichever thread is free. Only as many tiles as threads are in memory at
+ * once, so images can be streamed from and to disk.
+ */
+class TiledExecutor {
+
+public:
+
+    /**
+     * @param tile_size Side of the tiles, margins excluded. Must be positive.
+     */
+    explicit TiledExecutor(int tile_size = 512);
+
+    /**
+     * Filter an image in memory. Filters that need the whole image are applied to it directly.
+     * @param filter The filter. Called from many threads at once.
+     * @param image The image to filter.
+     * @param output The output, same size and type.
+     */
+    void apply(Filter &filter, const cv::Mat &image, cv::Mat &output);
+
+    /**
+     * Filter an image tile by tile.
+     * @param filter The filter. Called from many threads at once.
+     * @param source The image to filter.
+     * @param sink Where the output goes.
+     * @param cancelled Checked before each tile, the remaining tiles are skipped once it returns true.
+     * @return false if cancelled.
+     * @throws invalid_argument if the filter needs the whole image.
+     */
+    bool apply(
+            Filter &filter, TileSource &source, TileSink &sink, const std::function<bool()> &cancelled = nullptr
+    );
+
+protected:
+
+    int tile_size;
+
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/videoio.hpp>
+#include <opencv2/core/utils/filesystem.hpp>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include "undistort_pipeline.h"
+
+using namespace std;
+using namespace cv;
+
+namespace {
+
+// A frame moving through the pipeline.
+struct Frame {
+    Mat image;
+    // File name, for directories.
+    string name;
+};
+
+/**
+ * Queue between two stages. Producers block when it is full, consumers when it is empty.
+ */
+class FrameQueue {
+
+public:
+
+    explicit FrameQueue(size_t capacity) : capacity(capacity) {}
+
+    void push(Frame frame) {
+        unique_lock<mutex> lock(mutex_);
+        not_full.wait(lock, [this]() { return frames.size() < capacity || closed; });
+        if (closed)
+            return;
+        frames.push_back(std::move(frame));
+        not_empty.notify_one();
+    }
+
+    /**
+     * @return false once the queue is closed and empty.
+     */
+    bool pop(Frame &frame) {
+        unique_lock<mutex> lock(mutex_);
+        not_empty.wait(lock, [this]() { return !frames.empty() || closed; });
+        if (frames.empty())
+            return false;
+        frame = std::move(frames.front());
+        frames.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    // No more frames will be pushed. Also unblocks producers if the consumer gave up.
+    void close() {
+        lock_guard<mutex> lock(mutex_);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+
+    size_t capacity;
+    deque<Frame> frames;
+    bool closed = false;
+    mutex mutex_;
+    condition_variable not_empty;
+    condition_variable not_full;
+
+};
+
+/**
+ * @param directory A directory.
+ * @return The image files it contains, sorted by name.
+ */
+vector<string> imageFiles(const string &directory) {
+    vector<string> files;
+    for (auto pattern : {"*.png", "*.jpg", "*.jpeg", "*.bmp", "*.tif", "*.tiff"}) {
+        vector<string> found;
+        utils::fs::glob(directory, pattern, found);
+        files.insert(files.end(), found.begin(), found.end());
+    }
+    sort(files.begin(), files.end());
+    return files;
+}
+
+}
+
+PipelineReport undistortStream(
+        const CalibratedCamera &camera, const string &input, const string &output, int threads, int queue_size
+) {
+    bool directory = utils::fs::isDirectory(input);
+    vector<string> files;
+    VideoCapture capture;
+    if (directory) {
+        files = imageFiles(input);
+        utils::fs::createDirectories(output);
+    } else if (!capture.open(input)) {
+        throw invalid_argument("Could not open " + input + ".");
+    }
+
+    // Keep the input's codec and frame rate if possible. Read now, the capture then belongs to the decoder.
+    auto fourcc = (int) capture.get(CAP_PROP_FOURCC);
+    double fps = directory ? 0 : capture.get(CAP_PROP_FPS);
+    if (fps <= 0)
+        fps = 30;
+
+    FrameQueue decoded((size_t) queue_size), rectified((size_t) queue_size);
+    auto start = chrono::steady_clock::now();
+
+    // Errors of the helper threads are rethrown here once everything stopped.
+    exception_ptr decode_error, encode_error;
+
+    // Stage 1: decode.
+    thread decoder([&]() {
+        try {
+            if (directory) {
+                for (auto &file : files) {
+                    Frame frame;
+                    frame.image = imread(file);
+                    frame.name = file.substr(file.find_last_of("/\\") + 1);
+                    if (!frame.image.empty())
+                        decoded.push(std::move(frame));
+                }
+            } else {
+                Frame frame;
+                while (capture.read(frame.image)) {
+                    decoded.push(std::move(frame));
+                    frame = Frame();
+                }
+            }
+        } catch (...) {
+            decode_error = current_exception();
+        }
+        decoded.close();
+    });
+
+    // Stage 3: encode.
+    int written = 0;
+    thread encoder([&]() {
+        try {
+            VideoWriter writer;
+            Frame frame;
+            while (rectified.pop(frame)) {
+                if (directory) {
+                    string path = utils::fs::join(output, frame.name);
+                    if (!imwrite(path, frame.image))
+                        throw invalid_argument("Could not write " + path + ".");
+                } else {
+                    // Fall back to MJPG if the input's codec cannot be written.
+                    if (!writer.isOpened()) {
+                        if (!writer.open(output, fourcc, fps, frame.image.size()) &&
+                            !writer.open(output, VideoWriter::fourcc('M', 'J', 'P', 'G'), fps, frame.image.size()))
+                            throw invalid_argument("Could not write " + output + ".");
+                    }
+                    writer.write(frame.image);
+                }
+                written++;
+            }
+        } catch (...) {
+            encode_error = current_exception();
+        }
+        // Let the other stages stop if writing failed.
+        rectified.close();
+        decoded.close();
+    });
+
+    // Stage 2: remap, on this thread. The undistorter is rebuilt only if the frame size changes.
+    try {
+        unique_ptr<Undistorter> undistorter;
+        Frame frame;
+        while (decoded.pop(frame)) {
+            if (!undistorter || undistorter->size() != frame.image.size())
+                undistorter.reset(new Undistorter(camera, frame.image.size(), threads));
+            Frame result;
+            result.name = frame.name;
+            undistorter->apply(frame.image, result.image);
+            rectified.push(std::move(result));
+        }
+    } catch (...) {
+        // Stop the other stages, the threads must be joined before leaving.
+        decoded.close();
+        rectified.close();
+        decoder.join();
+        encoder.join();
+        throw;
+    }
+    rectified.close();
+
+    decoder.join();
+    encoder.join();
+    if (decode_error)
+        rethrow_exception(decode_error);
+    if (encode_error)
+        rethrow_exception(encode_error);
+
+    PipelineReport report;
+    report.frames = written;
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    report.fps = (report.seconds > 0) ? written / report.seconds : 0;
+    return report;
+}
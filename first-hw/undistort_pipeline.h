@@ -0,0 +1,35 @@
+#ifndef LAB2_UNDISTORT_PIPELINE_H
+#define LAB2_UNDISTORT_PIPELINE_H
+
+#include <string>
+#include "calibration.h"
+
+// Outcome of a run of the undistortion pipeline.
+struct PipelineReport {
+    // Frames rectified and written.
+    int frames = 0;
+    // Wall time of the whole run.
+    double seconds = 0;
+    // Frames per second over the whole run.
+    double fps = 0;
+};
+
+/**
+ * Rectify every frame of a video, or every image of a directory, without showing anything. Decoding, remapping and
+ * encoding run as three stages on their own threads, connected by bounded queues, so the slowest stage sets the pace
+ * and memory stays bounded. Remapping is further split in bands of rows (see Undistorter).
+ *
+ * @param camera The calibrated camera.
+ * @param input A video file, or a directory of images.
+ * @param output A video file if the input is a video, a directory otherwise. Images keep their file names.
+ * @param threads Threads used to remap each frame. 0 uses all cores.
+ * @param queue_size How many frames can wait between two stages.
+ * @return Frames processed and throughput.
+ * @throws invalid_argument if the input cannot be read or the output cannot be written.
+ */
+PipelineReport undistortStream(
+        const CalibratedCamera &camera, const std::string &input, const std::string &output,
+        int threads = 0, int queue_size = 4
+);
+
+#endif
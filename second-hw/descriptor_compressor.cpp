@@ -0,0 +1,90 @@
+/**
+ * @author Riccardo De Zen. 2019295.
+ */
+#include <opencv2/core/utils/filesystem.hpp>
+#include "descriptor_compressor.h"
+
+void DescriptorCompressor::train(const std::vector<cv::Mat> &samples, int dimensions, bool quantize) {
+    // Images without features have no rows to contribute.
+    std::vector<cv::Mat> rows;
+    for (auto &sample : samples)
+        if (!sample.empty())
+            rows.push_back(sample);
+    cv::Mat data;
+    cv::vconcat(rows, data);
+    data = rootSIFT(data);
+
+    // Learn the projection only if it actually reduces the dimensions.
+    pca = cv::PCA();
+    cv::Mat projected = data;
+    if (dimensions > 0 && dimensions < data.cols) {
+        pca = cv::PCA(data, cv::noArray(), cv::PCA::DATA_AS_ROW, dimensions);
+        projected = pca.project(data);
+    }
+
+    // A single scale for all dimensions keeps the L2 distances proportional.
+    double max_value = 0;
+    cv::minMaxIdx(cv::abs(projected), nullptr, &max_value);
+    scale = (max_value > 0) ? 127 / max_value : 1;
+
+    this->quantize = quantize;
+    ready = true;
+}
+
+bool DescriptorCompressor::trained() const {
+    return ready;
+}
+
+void DescriptorCompressor::save(const std::string &file) const {
+    cv::FileStorage fs(file, cv::FileStorage::WRITE);
+    fs << "quantize" << (int) quantize;
+    fs << "scale" << scale;
+    fs << "projected" << (int) !pca.eigenvectors.empty();
+    if (!pca.eigenvectors.empty())
+        pca.write(fs);
+}
+
+bool DescriptorCompressor::load(const std::string &file) {
+    if (!cv::utils::fs::exists(file))
+        return false;
+
+    cv::FileStorage fs(file, cv::FileStorage::READ);
+    quantize = (int) fs["quantize"] != 0;
+    fs["scale"] >> scale;
+    pca = cv::PCA();
+    if ((int) fs["projected"] != 0)
+        pca.read(fs.root());
+
+    ready = true;
+    return true;
+}
+
+cv::Mat DescriptorCompressor::compress(const cv::Mat &descriptors) const {
+    if (descriptors.empty())
+        return descriptors;
+
+    cv::Mat result = rootSIFT(descriptors);
+    if (!pca.eigenvectors.empty())
+        result = pca.project(result);
+
+    // Offset by 128 so the values fit unsigned bytes, which the matcher supports. Distances are unaffected.
+    // Float descriptors get the same scale, so distances are in quantization steps either way. Unscaled RootSIFT
+    // distances are all below 2, where the floor of 1 on the minimum distance of the ratio test accepts every match.
+    if (quantize)
+        result.convertTo(result, CV_8U, scale, 128);
+    else
+        result.convertTo(result, CV_32F, scale);
+
+    return result;
+}
+
+cv::Mat DescriptorCompressor::rootSIFT(const cv::Mat &descriptors) {
+    cv::Mat result;
+    descriptors.convertTo(result, CV_32F);
+    for (auto r = 0; r < result.rows; r++) {
+        cv::Mat row = result.row(r);
+        cv::normalize(row, row, 1, 0, cv::NORM_L1);
+    }
+    cv::sqrt(result, result);
+    return result;
+}
@@ -0,0 +1,70 @@
+/**
+ * @author Riccardo De Zen. 2019295.
+ */
+#ifndef LAB5_DESCRIPTOR_COMPRESSOR_H
+#define LAB5_DESCRIPTOR_COMPRESSOR_H
+
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+/**
+ * Turns SIFT descriptors into a compact form: RootSIFT normalization, PCA projection to fewer dimensions and optional
+ * 8 bit quantization. The projection is learned from a sample set of descriptors and can be saved to a file.
+ * Compressed descriptors are still compared with the L2 norm.
+ */
+class DescriptorCompressor {
+
+public:
+
+    /**
+     * Learn the projection.
+     * @param samples Float descriptors (one per row) to learn the projection from.
+     * @param dimensions Dimensions to keep. 0 or less, or more than the descriptors have, skips the projection.
+     * @param quantize If true, the projected values are quantized to 8 bits.
+     */
+    void train(const std::vector<cv::Mat> &samples, int dimensions, bool quantize);
+
+    /**
+     * @return True if the compressor has been trained or loaded.
+     */
+    bool trained() const;
+
+    /**
+     * @param file Where to save the projection. Must have an extension supported by cv::FileStorage.
+     */
+    void save(const std::string &file) const;
+
+    /**
+     * @param file File previously written by save().
+     * @return false if the file does not exist.
+     */
+    bool load(const std::string &file);
+
+    /**
+     * @param descriptors Float descriptors, one per row.
+     * @return The compact descriptors, one per row. CV_8U if quantized, CV_32F otherwise, scaled like the quantized
+     * ones so that their distances have the same units.
+     */
+    cv::Mat compress(const cv::Mat &descriptors) const;
+
+    /**
+     * @param descriptors Float descriptors, one per row.
+     * @return The RootSIFT descriptors: L1 normalized rows, then square rooted.
+     */
+    static cv::Mat rootSIFT(const cv::Mat &descriptors);
+
+protected:
+
+    bool ready = false;
+    bool quantize = false;
+
+    // Projection, empty if the dimensions are kept.
+    cv::PCA pca;
+
+    // Multiplier mapping the projected values to [-127, 127].
+    double scale = 1;
+
+};
+
+#endif
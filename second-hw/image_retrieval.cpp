@@ -0,0 +1,83 @@
+/**
+ * @author Riccardo De Zen. 2019295.
+ */
+#include <algorithm>
+#include <opencv2/features2d.hpp>
+#include "image_retrieval.h"
+
+VLADIndex::VLADIndex(int words, int samples_per_image) {
+    this->words = words;
+    this->samples_per_image = samples_per_image;
+}
+
+void VLADIndex::build(const std::vector<cv::Mat> &descriptors) {
+    auto N = descriptors.size();
+
+    // K-means works on floats, binary descriptors are just treated as vectors of bytes.
+    std::vector<cv::Mat> float_descriptors(N);
+    for (auto i = 0; i < N; i++)
+        descriptors[i].convertTo(float_descriptors[i], CV_32F);
+
+    // Sample evenly spaced descriptors of each image.
+    cv::Mat samples;
+    for (auto &d : float_descriptors) {
+        int step = std::max(1, d.rows / samples_per_image);
+        for (auto r = 0; r < d.rows; r += step)
+            samples.push_back(d.row(r));
+    }
+
+    // Learn the vocabulary.
+    int k = std::max(1, std::min(words, samples.rows));
+    cv::Mat labels;
+    cv::kmeans(
+            samples, k, labels,
+            cv::TermCriteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, 20, 1e-3),
+            3, cv::KMEANS_PP_CENTERS, vocabulary
+    );
+
+    // Compute and index the signatures.
+    signatures = cv::Mat();
+    for (auto &d : float_descriptors)
+        signatures.push_back(encode(d));
+    index = cv::makePtr<cv::flann::Index>(signatures, cv::flann::KDTreeIndexParams(4));
+}
+
+std::vector<int> VLADIndex::neighbours(int image, int k) {
+    // Ask for one more, since the image itself is found too.
+    int count = std::min(k + 1, signatures.rows);
+    cv::Mat indices, distances;
+    index->knnSearch(signatures.row(image), indices, distances, count, cv::flann::SearchParams(64));
+
+    std::vector<int> result;
+    for (auto j = 0; j < indices.cols && result.size() < k; j++) {
+        int other = indices.at<int>(0, j);
+        if (other != image && other >= 0)
+            result.push_back(other);
+    }
+    return result;
+}
+
+cv::Mat VLADIndex::encode(const cv::Mat &descriptors) const {
+    cv::Mat signature = cv::Mat::zeros(vocabulary.rows, vocabulary.cols, CV_32F);
+    if (descriptors.empty())
+        return signature.reshape(1, 1);
+
+    // Assign each descriptor to its closest word and accumulate the residuals.
+    std::vector<cv::DMatch> assignments;
+    cv::BFMatcher(cv::NORM_L2).match(descriptors, vocabulary, assignments);
+    for (auto &a : assignments) {
+        cv::Mat word_residuals = signature.row(a.trainIdx);
+        word_residuals += descriptors.row(a.queryIdx) - vocabulary.row(a.trainIdx);
+    }
+
+    // Power normalization reduces the weight of repeated structures, then L2 normalization.
+    signature = signature.reshape(1, 1);
+    cv::Mat magnitude;
+    cv::sqrt(cv::abs(signature), magnitude);
+    for (auto c = 0; c < signature.cols; c++)
+        signature.at<float>(0, c) = (signature.at<float>(0, c) < 0) ? -magnitude.at<float>(0, c)
+                                                                    : magnitude.at<float>(0, c);
+    cv::normalize(signature, signature);
+
+    return signature;
+}
@@ -0,0 +1,59 @@
+/**
+ * @author Riccardo De Zen. 2019295.
+ */
+#ifndef LAB5_IMAGE_RETRIEVAL_H
+#define LAB5_IMAGE_RETRIEVAL_H
+
+#include <vector>
+#include <opencv2/core.hpp>
+#include <opencv2/flann.hpp>
+
+/**
+ * Index of images described by a VLAD signature (Vector of Locally Aggregated Descriptors): the residuals of each
+ * image's descriptors from a small k-means vocabulary, concatenated and normalized. Used to propose which images are
+ * likely to overlap without matching all pairs.
+ */
+class VLADIndex {
+
+public:
+
+    /**
+     * @param words Size of the vocabulary.
+     * @param samples_per_image How many descriptors of each image are used to learn the vocabulary, at most.
+     */
+    explicit VLADIndex(int words = 16, int samples_per_image = 200);
+
+    /**
+     * Learn the vocabulary, compute the signature of each image and index them.
+     * @param descriptors Descriptors of each image, one per row.
+     */
+    void build(const std::vector<cv::Mat> &descriptors);
+
+    /**
+     * @param image Index of the query image.
+     * @param k How many neighbours to find.
+     * @return Up to k images with the closest signatures, closest first. The query image is excluded.
+     */
+    std::vector<int> neighbours(int image, int k);
+
+protected:
+
+    int words;
+    int samples_per_image;
+
+    // One word per row.
+    cv::Mat vocabulary;
+
+    // One signature per row. Referenced by the index, must outlive it.
+    cv::Mat signatures;
+    cv::Ptr<cv::flann::Index> index;
+
+    /**
+     * @param descriptors Float descriptors of an image, one per row.
+     * @return The VLAD signature of the image, as a single row.
+     */
+    cv::Mat encode(const cv::Mat &descriptors) const;
+
+};
+
+#endif
@@ -2,11 +2,13 @@
  * @author Riccardo De Zen. 2019295.
  */
 #include <iostream>
+#include <memory>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/core/utils/filesystem.hpp>
 #include "panoramic_utils.h"
 #include "panoramic.h"
+#include "memory_profiler.h"
 
 using namespace std;
 using namespace cv;
@@ -26,8 +28,20 @@ static void show_usage(const string &name) {
               << "\t-f, --fov ANGLE\t\tField of view of the camera used to take the pictures."
               << " Defaults to 66.\n"
               // Direction of pictures
-              << "\t-d, --direction l|r\tDirection of the picture. \"l\" for right to left, \"r\" for left to right."
-              << " Defaults to \"r\"."
+              << "\t-d, --direction l|r|u\tDirection of the picture. \"l\" for right to left, \"r\" for left to right,"
+              << " \"u\" if the pictures are not sorted. Defaults to \"r\".\n"
+              // Alignment method
+              << "\t-a, --align METHOD\tHow to align the pictures: \"sift\", \"orb\" or \"phase\" (phase correlation,"
+              << " for pure translations). Defaults to \"sift\".\n"
+              // Key point budget
+              << "\t-k, --keypoints N\tMaximum number of key points per image, picked spread over the image and"
+              << " adapted from pair to pair. Defaults to 0 (no limit).\n"
+              // Compact descriptors
+              << "\t-c, --compact FILE\tMatch compact SIFT descriptors (RootSIFT, PCA to 32 dimensions, 8 bits) using"
+              << " the projection in FILE. It is learned from the images and saved there if FILE does not exist.\n"
+              // Memory report
+              << "\t-m, --memory POOL_MB\tReport the memory used by each stage at exit. Freed buffers up to POOL_MB"
+              << " megabytes are reused, 0 disables the pool."
               << std::endl;
 }
 
@@ -43,6 +57,9 @@ int main(int argc, char **argv) {
     string SUFFIX = "bmp";
     double FOV = 66;
     int DIRECTION = PanoramicImage::RIGHT;
+    string ALIGN = "sift";
+    int KEYPOINTS = 0;
+    string COMPACT_FILE;
 
     // Command line arguments parsing ---
     if (argc > 1) {
@@ -93,10 +110,48 @@ int main(int argc, char **argv) {
                     DIRECTION = PanoramicImage::RIGHT;
                 else if (val == "l")
                     DIRECTION = PanoramicImage::LEFT;
+                else if (val == "u")
+                    DIRECTION = PanoramicImage::UNORDERED;
                 else {
                     show_usage(argv[0]);
                     return 1;
                 }
+            } else if ((arg == "-a") || (arg == "--align")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Set method if value is appropriate.
+                ALIGN = argv[++i];
+                if (ALIGN != "sift" && ALIGN != "orb" && ALIGN != "phase") {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+            } else if ((arg == "-k") || (arg == "--keypoints")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the budget.
+                KEYPOINTS = stoi(argv[++i]);
+            } else if ((arg == "-c") || (arg == "--compact")) {
+                // No file -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Skip next argument cause it is the file.
+                COMPACT_FILE = argv[++i];
+            } else if ((arg == "-m") || (arg == "--memory")) {
+                // No value -> error.
+                if (argv[i + 1] == nullptr) {
+                    show_usage(argv[0]);
+                    return 1;
+                }
+                // Install the profiler before any image is loaded.
+                MemoryProfiler::install((size_t) stoi(argv[++i]) * 1048576);
             }
         }
     }
@@ -109,15 +164,28 @@ int main(int argc, char **argv) {
     // Linear interpolation is enabled by default. I did not think it should have been a separate option.
     // It is found at lines 257 - 284 of panoramic.cpp
     // SIFT with 10 distance ratio already works on all datasets.
-    SIFTPanoramicImage sift_image(images, FOV / 2, 10, DIRECTION);
-    vector<Mat> sift_results = sift_image.getAll(true);
-    Mat sift_comparison;
-    cv::vconcat(sift_results, sift_comparison);
-    namedWindow("SIFT", WINDOW_NORMAL);
-    imshow("SIFT", sift_comparison);
-
-    namedWindow("SIFT match example", WINDOW_NORMAL);
-    imshow("SIFT match example", sift_image.matchImages()[0]);
+    unique_ptr<PanoramicImage> panoramic_image;
+    if (ALIGN == "orb")
+        panoramic_image.reset(new ORBPanoramicImage(images, FOV / 2, 10, DIRECTION));
+    else if (ALIGN == "phase")
+        panoramic_image.reset(new PhaseCorrelationPanoramicImage(images, FOV / 2, 10, DIRECTION));
+    else {
+        auto sift_image = new SIFTPanoramicImage(images, FOV / 2, 10, DIRECTION);
+        if (!COMPACT_FILE.empty())
+            sift_image->setCompactDescriptors(COMPACT_FILE);
+        panoramic_image.reset(sift_image);
+    }
+    panoramic_image->setKeypointBudget(KEYPOINTS);
+
+    string window = (ALIGN == "phase") ? "Phase correlation" : (ALIGN == "orb") ? "ORB" : "SIFT";
+    vector<Mat> results = panoramic_image->getAll(true);
+    Mat comparison;
+    cv::vconcat(results, comparison);
+    namedWindow(window, WINDOW_NORMAL);
+    imshow(window, comparison);
+
+    namedWindow(window + " match example", WINDOW_NORMAL);
+    imshow(window + " match example", panoramic_image->matchImages()[0]);
 
     waitKey();
 
@@ -2,15 +2,25 @@
  * @author Riccardo De Zen. 2019295.
  */
 #include <utility>
+#include <algorithm>
 #include <opencv2/core.hpp>
 #include <opencv2/features2d.hpp>
 #include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
 #include <cmath>
+#include <functional>
+#include <set>
 #include "panoramic_utils.h"
 #include "panoramic.h"
+#include "image_retrieval.h"
+#include "memory_profiler.h"
 
 const int PanoramicImage::RIGHT = 0;
 const int PanoramicImage::LEFT = 1;
+const int PanoramicImage::UNORDERED = 2;
+
+const int PanoramicImage::GRID = 0;
+const int PanoramicImage::ANMS = 1;
 
 PanoramicImage::PanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction) {
     // Moving vector because it is passed by value on purpose.
@@ -21,6 +31,13 @@ PanoramicImage::PanoramicImage(std::vector<cv::Mat> images, double half_fov, dou
     // If images are right to left, flip their order.
     if (direction == PanoramicImage::LEFT)
         std::reverse(original_images.begin(), original_images.end());
+
+    // If they are not sorted at all, they are sorted when the shifts are first computed.
+    this->unordered = (direction == PanoramicImage::UNORDERED);
+}
+
+void PanoramicImage::setCandidates(int candidates) {
+    this->candidates = candidates;
 }
 
 cv::Mat PanoramicImage::get(bool gray, bool equalize, bool draw) {
@@ -38,6 +55,7 @@ cv::Mat PanoramicImage::get(bool gray, bool equalize, bool draw) {
         prepareShifts((draw) ? &match_images : nullptr);
 
     // Prepare material images vector if not prepared yet.
+    MemoryScope scope("compositing");
     auto N = projected_images.size();
 
     // projected_images and projected_gray are both already available after feature matching.
@@ -73,7 +91,15 @@ std::vector<cv::Mat> PanoramicImage::matchImages() {
     return match_images;
 }
 
+void PanoramicImage::setKeypointBudget(int budget, int selection, bool adaptive) {
+    keypoint_budget = std::max(0, budget);
+    current_budget = keypoint_budget;
+    keypoint_selection = selection;
+    adaptive_budget = adaptive;
+}
+
 void PanoramicImage::projectImages() {
+    MemoryScope scope("projection");
     auto N = original_images.size();
     projected_images.resize(N);
     projected_gray.resize(N);
@@ -103,45 +129,20 @@ void PanoramicImage::prepareShifts(std::vector<cv::Mat> *draw_destination) {
 
     auto N = projected_images.size();
 
-    // Pre-load keypoint and descriptor vectors.
-    std::vector<std::vector<cv::KeyPoint>> key_points(N);
-    std::vector<cv::Mat> descriptors(N);
+    // Pre-load keypoint and descriptor vectors. They are filled by computeFeatures().
+    detector = getDetector();
+    key_points.assign(N, std::vector<cv::KeyPoint>());
+    descriptors.assign(N, cv::Mat());
+    features_ready.assign(N, false);
+    current_budget = keypoint_budget;
 
-    // Find key points and descriptors for each image.
-    cv::Ptr<cv::Feature2D> detector = getDetector();
-    for (auto i = 0; i < N; i++)
-        detector->detectAndCompute(projected_gray[i], cv::noArray(), key_points[i], descriptors[i]);
+    if (unordered)
+        sortImages();
 
-    // Create matcher.
-    cv::Ptr<cv::BFMatcher> matcher = cv::BFMatcher::create(cv::NORM_L2, false);
+    // Matches for each pair (all but last image).
     std::vector<std::vector<cv::DMatch>> all_matches(N - 1);
 
-    // Match pairs (all but last image).
-    for (auto i = 0; i < N - 1; i++)
-        matcher->match(descriptors[i], descriptors[i + 1], all_matches[i]);
-
-    // Find minimum distance and take only the matches that are below such distance * dist_ratio.
-    for (auto &matches : all_matches) {
-        std::vector<cv::DMatch> close_matches;
-        // Find minimum distance.
-        auto min_distance = matches[0].distance;
-        for (auto &match : matches)
-            if (match.distance < min_distance)
-                min_distance = match.distance;
-
-        // Set min_distance to at least 1.
-        min_distance = std::max(1.0f, min_distance);
-
-        // Only take matches that are below threshold.
-        for (auto &match : matches)
-            if (match.distance <= (min_distance * dist_ratio))
-                close_matches.push_back(match);
-
-        // Replace matches.
-        matches = close_matches;
-    }
-
-    // Find appropriate matches with ransac and compute average distance between pictures.
+    // Compute the shift between pictures.
     shift_x.resize(all_matches.size());
     shift_y.resize(all_matches.size());
 
@@ -157,39 +158,11 @@ void PanoramicImage::prepareShifts(std::vector<cv::Mat> *draw_destination) {
     lower_y = 0;
 
     for (auto i = 0; i < all_matches.size(); i++) {
-        // Get points in the two images.
-        std::vector<cv::Point2f> left_points;
-        std::vector<cv::Point2f> right_points;
-        for (auto j = 0; j < all_matches[i].size(); j++) {
-            // Get the key points from the good matches
-            left_points.push_back(key_points[i][all_matches[i][j].queryIdx].pt);
-            right_points.push_back(key_points[i + 1][all_matches[i][j].trainIdx].pt);
-        }
-        std::vector<int> mask;
-        std::vector<cv::DMatch> homography_matches;
-        findHomography(left_points, right_points, mask, cv::RANSAC);
-
-        double sum_dx = 0, sum_dy = 0;
-        int count_dx = 0, count_dy = 0;
-        for (auto j = 0; j < mask.size(); j++) {
-            if (!mask[j])
-                continue;
-            // Copy best matches to draw them later.
-            homography_matches.push_back(all_matches[i][j]);
-            // Images go right, always positive.
-            sum_dx += left_points[j].x - right_points[j].x;
-            // Images can go up and down, average can be 0. Take lowest and highest values found.
-            sum_dy += left_points[j].y - right_points[j].y;
-            count_dx++;
-            count_dy++;
-        }
-
-        // Replace old matches.
-        all_matches[i] = homography_matches;
+        cv::Point2d shift = estimateShift(i, all_matches[i]);
 
         // Truncating is wiser. If I round I risk a segmentation fault.
-        shift_x[i] = (int) round(sum_dx / count_dx);
-        shift_y[i] = (int) round(sum_dy / count_dy);
+        shift_x[i] = (int) round(shift.x);
+        shift_y[i] = (int) round(shift.y);
 
         // The total shift (allows negatives).
         cumulative_y += shift_y[i];
@@ -218,6 +191,287 @@ void PanoramicImage::prepareShifts(std::vector<cv::Mat> *draw_destination) {
     }
 }
 
+void PanoramicImage::sortImages() {
+    auto N = projected_images.size();
+    unordered = false;
+    if (N < 3)
+        return;
+
+    // Index the images by a global signature of their features.
+    for (auto i = 0; i < N; i++)
+        computeFeatures(i);
+    VLADIndex index;
+    index.build(descriptors);
+
+    // Only match each image with the few most similar ones. Keep the pairs with enough inliers.
+    struct Edge {
+        int a, b;
+        int inliers;
+        double dx;
+    };
+    std::vector<Edge> edges;
+    std::set<std::pair<int, int>> tried;
+    for (auto i = 0; i < N; i++) {
+        for (auto j : index.neighbours(i, candidates)) {
+            if (!tried.insert({std::min(i, j), std::max(i, j)}).second)
+                continue;
+            std::vector<cv::DMatch> matches, close_matches;
+            cv::Point2d shift = matchFeatures(i, j, matches, close_matches);
+            if (matches.size() >= 10)
+                edges.push_back({i, j, (int) matches.size(), shift.x});
+        }
+    }
+
+    // Maximum spanning forest over the pairs, strongest pairs first.
+    std::sort(edges.begin(), edges.end(), [](const Edge &e1, const Edge &e2) { return e1.inliers > e2.inliers; });
+    std::vector<int> component(N);
+    for (auto i = 0; i < N; i++)
+        component[i] = i;
+    std::function<int(int)> root = [&](int i) { return (component[i] == i) ? i : (component[i] = root(component[i])); };
+    std::vector<std::vector<std::pair<int, double>>> tree(N);
+    for (auto &e : edges) {
+        int root_a = root(e.a), root_b = root(e.b);
+        if (root_a == root_b)
+            continue;
+        component[root_a] = root_b;
+        // Image b is dx to the right of image a.
+        tree[e.a].emplace_back(e.b, e.dx);
+        tree[e.b].emplace_back(e.a, -e.dx);
+    }
+
+    // Place the images along the horizontal axis walking the tree. Disconnected groups are laid after each other.
+    std::vector<double> position(N, 0);
+    std::vector<bool> placed(N, false);
+    double next_start = 0;
+    for (auto start = 0; start < N; start++) {
+        if (placed[start])
+            continue;
+        std::vector<int> group = {start};
+        placed[start] = true;
+        for (auto g = 0; g < group.size(); g++) {
+            for (auto &next : tree[group[g]]) {
+                if (placed[next.first])
+                    continue;
+                placed[next.first] = true;
+                position[next.first] = position[group[g]] + next.second;
+                group.push_back(next.first);
+            }
+        }
+        double min_position = position[start], max_position = position[start];
+        for (auto i : group) {
+            min_position = std::min(min_position, position[i]);
+            max_position = std::max(max_position, position[i]);
+        }
+        for (auto i : group)
+            position[i] += next_start - min_position;
+        next_start += max_position - min_position + 1;
+    }
+
+    // Sort everything that was computed per image.
+    std::vector<int> order(N);
+    for (auto i = 0; i < N; i++)
+        order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](int i, int j) { return position[i] < position[j]; });
+
+    auto permute = [&](auto &items) {
+        auto sorted = items;
+        for (auto i = 0; i < N; i++)
+            sorted[i] = items[order[i]];
+        items = sorted;
+    };
+    permute(original_images);
+    permute(projected_images);
+    permute(projected_gray);
+    permute(key_points);
+    permute(descriptors);
+}
+
+void PanoramicImage::computeFeatures(int i) {
+    if (features_ready[i])
+        return;
+
+    MemoryScope scope("features");
+    if (current_budget <= 0) {
+        // Find key points and descriptors for the image.
+        detector->detectAndCompute(projected_gray[i], cv::noArray(), key_points[i], descriptors[i]);
+    } else {
+        // Select the key points before describing them, so discarded ones cost nothing.
+        detector->detect(projected_gray[i], key_points[i]);
+        if (keypoint_selection == PanoramicImage::GRID)
+            selectGrid(key_points[i], current_budget, projected_gray[i].size());
+        else
+            selectANMS(key_points[i], current_budget, projected_gray[i].size());
+        detector->compute(projected_gray[i], key_points[i], descriptors[i]);
+    }
+    features_ready[i] = true;
+}
+
+void PanoramicImage::adaptBudget(double inlier_ratio) {
+    if (!adaptive_budget || keypoint_budget <= 0)
+        return;
+
+    // Plenty of inliers means the budget can shrink, few inliers means the pair needed more points.
+    if (inlier_ratio > 0.5)
+        current_budget = (int) (current_budget * 0.8);
+    else if (inlier_ratio < 0.2)
+        current_budget = (int) (current_budget * 1.25);
+
+    current_budget = std::min(std::max(current_budget, keypoint_budget / 4), keypoint_budget * 4);
+}
+
+void PanoramicImage::selectGrid(std::vector<cv::KeyPoint> &points, int budget, const cv::Size &size) {
+    if (points.size() <= budget)
+        return;
+
+    // Put each point in its cell.
+    const int grid_cols = 8, grid_rows = 8;
+    std::vector<std::vector<cv::KeyPoint>> cells(grid_cols * grid_rows);
+    for (auto &point : points) {
+        int col = std::min(grid_cols - 1, std::max(0, (int) (point.pt.x * grid_cols / size.width)));
+        int row = std::min(grid_rows - 1, std::max(0, (int) (point.pt.y * grid_rows / size.height)));
+        cells[row * grid_cols + col].push_back(point);
+    }
+
+    // Strongest points first in each cell.
+    for (auto &cell : cells)
+        std::sort(cell.begin(), cell.end(), [](const cv::KeyPoint &a, const cv::KeyPoint &b) {
+            return a.response > b.response;
+        });
+
+    // Take the best remaining point of each cell in turn, so sparse cells are not starved by dense ones.
+    std::vector<cv::KeyPoint> selected;
+    selected.reserve(budget);
+    for (auto rank = 0; selected.size() < budget; rank++) {
+        for (auto &cell : cells) {
+            if (rank < cell.size() && selected.size() < budget)
+                selected.push_back(cell[rank]);
+        }
+    }
+
+    points = selected;
+}
+
+void PanoramicImage::selectANMS(std::vector<cv::KeyPoint> &points, int budget, const cv::Size &size) {
+    if (points.size() <= budget)
+        return;
+
+    // Points are suppressed in order of response.
+    std::sort(points.begin(), points.end(), [](const cv::KeyPoint &a, const cv::KeyPoint &b) {
+        return a.response > b.response;
+    });
+
+    // Greedily keep the strongest points that are not within radius of an already kept one. A grid of cells of half
+    // the radius keeps track of the covered areas, so each attempt is linear in the number of points.
+    auto suppress = [&](double radius, std::vector<cv::KeyPoint> &kept) {
+        double cell = std::max(1.0, radius / 2);
+        int cols = (int) (size.width / cell) + 1;
+        int rows = (int) (size.height / cell) + 1;
+        int reach = (int) std::ceil(radius / cell);
+        std::vector<bool> covered(cols * rows, false);
+
+        kept.clear();
+        for (auto &point : points) {
+            int col = std::min(cols - 1, std::max(0, (int) (point.pt.x / cell)));
+            int row = std::min(rows - 1, std::max(0, (int) (point.pt.y / cell)));
+            if (covered[row * cols + col])
+                continue;
+            kept.push_back(point);
+            for (auto r = std::max(0, row - reach); r <= std::min(rows - 1, row + reach); r++)
+                for (auto c = std::max(0, col - reach); c <= std::min(cols - 1, col + reach); c++)
+                    covered[r * cols + c] = true;
+        }
+    };
+
+    // Binary search for the smallest radius that keeps no more than the budget.
+    double low = 0, high = std::max(size.width, size.height);
+    std::vector<cv::KeyPoint> kept, best;
+    suppress(high, best);
+    for (auto iteration = 0; iteration < 16 && high - low > 0.5; iteration++) {
+        double radius = (low + high) / 2;
+        suppress(radius, kept);
+        if (kept.size() > budget) {
+            low = radius;
+        } else {
+            high = radius;
+            best.swap(kept);
+        }
+    }
+
+    points = best;
+}
+
+cv::Point2d PanoramicImage::estimateShift(int i, std::vector<cv::DMatch> &matches) {
+    std::vector<cv::DMatch> close_matches;
+    cv::Point2d shift = matchFeatures(i, i + 1, matches, close_matches);
+    adaptBudget(close_matches.empty() ? 0 : (double) matches.size() / close_matches.size());
+    return shift;
+}
+
+cv::Point2d PanoramicImage::matchFeatures(
+        int a, int b, std::vector<cv::DMatch> &matches, std::vector<cv::DMatch> &close_matches
+) {
+    computeFeatures(a);
+    computeFeatures(b);
+
+    MemoryScope scope("matching");
+    // Create matcher and match the pair.
+    cv::Ptr<cv::BFMatcher> matcher = cv::BFMatcher::create(cv::NORM_L2, false);
+    matcher->match(descriptors[a], descriptors[b], matches);
+    close_matches.clear();
+    if (matches.empty())
+        return {0, 0};
+
+    // Find minimum distance and take only the matches that are below such distance * dist_ratio.
+    // Find minimum distance.
+    auto min_distance = matches[0].distance;
+    for (auto &match : matches)
+        if (match.distance < min_distance)
+            min_distance = match.distance;
+
+    // Set min_distance to at least 1.
+    min_distance = std::max(1.0f, min_distance);
+
+    // Only take matches that are below threshold.
+    for (auto &match : matches)
+        if (match.distance <= (min_distance * dist_ratio))
+            close_matches.push_back(match);
+
+    // Find appropriate matches with ransac and compute average distance between pictures.
+    // Get points in the two images.
+    std::vector<cv::Point2f> left_points;
+    std::vector<cv::Point2f> right_points;
+    for (auto &match : close_matches) {
+        // Get the key points from the good matches
+        left_points.push_back(key_points[a][match.queryIdx].pt);
+        right_points.push_back(key_points[b][match.trainIdx].pt);
+    }
+    std::vector<int> mask;
+    std::vector<cv::DMatch> homography_matches;
+    findHomography(left_points, right_points, mask, cv::RANSAC);
+
+    double sum_dx = 0, sum_dy = 0;
+    int count_dx = 0, count_dy = 0;
+    for (auto j = 0; j < mask.size(); j++) {
+        if (!mask[j])
+            continue;
+        // Copy best matches to draw them later.
+        homography_matches.push_back(close_matches[j]);
+        // Images go right, always positive.
+        sum_dx += left_points[j].x - right_points[j].x;
+        // Images can go up and down, average can be 0. Take lowest and highest values found.
+        sum_dy += left_points[j].y - right_points[j].y;
+        count_dx++;
+        count_dy++;
+    }
+
+    // Replace old matches.
+    matches = homography_matches;
+    if (matches.empty())
+        return {0, 0};
+
+    return {sum_dx / count_dx, sum_dy / count_dy};
+}
+
 cv::Mat PanoramicImage::makePanoramic(
         const std::vector<cv::Mat> &material_images,
         cv::Mat &result_dest
@@ -321,17 +575,114 @@ SIFTPanoramicImage::SIFTPanoramicImage(std::vector<cv::Mat> images, double half_
         : PanoramicImage(std::move(images), half_fov, dist_ratio, direction) {
 }
 
+void SIFTPanoramicImage::setCompactDescriptors(const std::string &projection_file, int dimensions, bool quantize) {
+    this->projection_file = projection_file;
+    this->compact_dimensions = dimensions;
+    this->compact_quantize = quantize;
+}
+
 cv::Ptr<cv::Feature2D> SIFTPanoramicImage::getDetector() {
     return cv::SIFT::create();
 }
 
+void SIFTPanoramicImage::computeFeatures(int i) {
+    if (projection_file.empty() || features_ready[i]) {
+        PanoramicImage::computeFeatures(i);
+        return;
+    }
+
+    if (!compressor.trained())
+        prepareCompressor();
+
+    // Training might have already computed the image's features.
+    if (features_ready[i])
+        return;
+
+    PanoramicImage::computeFeatures(i);
+    descriptors[i] = compressor.compress(descriptors[i]);
+}
+
+void SIFTPanoramicImage::prepareCompressor() {
+    if (compressor.load(projection_file))
+        return;
+
+    // Learn from the full descriptors of all images, then compress them.
+    auto N = projected_gray.size();
+    for (auto i = 0; i < N; i++)
+        PanoramicImage::computeFeatures(i);
+    compressor.train(descriptors, compact_dimensions, compact_quantize);
+    compressor.save(projection_file);
+    for (auto i = 0; i < N; i++)
+        descriptors[i] = compressor.compress(descriptors[i]);
+}
+
 
 // ORB ---
 
-ORBPanoramicImage::ORBPanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction)
+ORBPanoramicImage::ORBPanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction,
+                                     int n_features)
         : PanoramicImage(std::move(images), half_fov, dist_ratio, direction) {
+    this->n_features = n_features;
 }
 
 cv::Ptr<cv::Feature2D> ORBPanoramicImage::getDetector() {
-    return cv::ORB::create(5000);
-}
\ No newline at end of file
+    return cv::ORB::create(n_features);
+}
+
+
+// Phase correlation ---
+
+PhaseCorrelationPanoramicImage::PhaseCorrelationPanoramicImage(
+        std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction,
+        double overlap, int pyramid_levels, double min_response
+) : PanoramicImage(std::move(images), half_fov, dist_ratio, direction) {
+    this->overlap = overlap;
+    this->pyramid_levels = pyramid_levels;
+    this->min_response = min_response;
+}
+
+std::vector<double> PhaseCorrelationPanoramicImage::responses() {
+    return pair_responses;
+}
+
+cv::Ptr<cv::Feature2D> PhaseCorrelationPanoramicImage::getDetector() {
+    return cv::SIFT::create();
+}
+
+cv::Point2d PhaseCorrelationPanoramicImage::estimateShift(int i, std::vector<cv::DMatch> &matches) {
+    MemoryScope scope("matching");
+    pair_responses.resize(projected_gray.size() - 1);
+
+    // The right band of the left image should contain the left band of the right image.
+    int width = projected_gray[i].cols;
+    int band = std::min(width, std::max(1, (int) round(width * overlap)));
+    cv::Mat left_band, right_band;
+    projected_gray[i].colRange(width - band, width).convertTo(left_band, CV_32F);
+    projected_gray[i + 1].colRange(0, band).convertTo(right_band, CV_32F);
+
+    // Correlate on a smaller pyramid level if requested.
+    for (auto l = 0; l < pyramid_levels; l++) {
+        cv::pyrDown(left_band, left_band);
+        cv::pyrDown(right_band, right_band);
+    }
+
+    // Window the bands to reduce the effect of their borders on the spectrum.
+    cv::Mat window;
+    cv::createHanningWindow(window, left_band.size(), CV_32F);
+
+    double response = 0;
+    cv::Point2d offset = cv::phaseCorrelate(left_band, right_band, window, &response);
+    pair_responses[i] = response;
+
+    // Offset is measured between the bands, bring it back to the images' coordinates.
+    double scale = (double) (1 << pyramid_levels);
+    cv::Point2d shift((width - band) - offset.x * scale, -offset.y * scale);
+
+    // Use the shift only if the peak is reliable and the images actually go right.
+    if (response >= min_response && shift.x > 0 && shift.x < width) {
+        matches.clear();
+        return shift;
+    }
+
+    return PanoramicImage::estimateShift(i, matches);
+}
@@ -5,6 +5,7 @@
 #define LAB5_PANORAMIC_H
 
 #include <opencv2/core/types.hpp>
+#include "descriptor_compressor.h"
 
 /**
  * Base abstract class for a Panoramic image.
@@ -16,14 +17,23 @@ public:
 
     static const int RIGHT;
     static const int LEFT;
+    static const int UNORDERED;
+
+    // Key point selection strategies.
+    static const int GRID;
+    static const int ANMS;
 
     /**
      * @param images Vector of images sorted left to right.
      * @param half_fov Half the field of view with which the images were taken.
      * @param dist_ratio Only matches below dist_ratio times the minimum distance are considered.
+     * @param direction RIGHT if the images go left to right, LEFT if they go right to left, UNORDERED if they must be
+     *        sorted first. Unordered images are only matched with a few candidates found by image retrieval.
      */
     explicit PanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction = RIGHT);
 
+    virtual ~PanoramicImage() = default;
+
     /**
      * @param gray If true, compute the result with the grayscale images.
      * @param equalize If true, use equalized images to compute the result.
@@ -47,11 +57,31 @@ public:
      */
     std::vector<cv::Mat> matchImages();
 
+    /**
+     * Limit how many key points are described and matched for each image. Must be called before the shifts are
+     * computed by `get(bool, bool, bool)`.
+     * @param budget Maximum number of key points per image. 0 or less disables the limit.
+     * @param selection How to pick the key points to keep: GRID keeps the strongest ones of each cell of a grid, ANMS
+     *        keeps the strongest ones that are far enough from each other (adaptive non-maximal suppression).
+     * @param adaptive If true, the budget of each new image is adjusted from the inlier ratio of the previous pair,
+     *        staying between a quarter and four times the given budget.
+     */
+    void setKeypointBudget(int budget, int selection = ANMS, bool adaptive = true);
+
+    /**
+     * @param candidates How many similar images each image is matched with when sorting unordered images.
+     */
+    void setCandidates(int candidates);
+
 protected:
     // Params
     double half_fov;
     double dist_ratio;
 
+    // Whether the images still need to be sorted, and how many candidate neighbours to try for each.
+    bool unordered = false;
+    int candidates = 4;
+
     // Shifts and such for final image creation.
     // Only need to be computed once since matches are always computed on
     // grayscale non-equalized images.
@@ -87,6 +117,19 @@ protected:
     // non-equalized grayscale image.
     std::vector<cv::Mat> match_images;
 
+    // Key points and descriptors of the projected grayscale images.
+    // Computed lazily by computeFeatures(), since some pairs may not need them.
+    cv::Ptr<cv::Feature2D> detector;
+    std::vector<std::vector<cv::KeyPoint>> key_points;
+    std::vector<cv::Mat> descriptors;
+    std::vector<bool> features_ready;
+
+    // Key point budget. The current budget changes during matching if adaptive.
+    int keypoint_budget = 0;
+    int current_budget = 0;
+    int keypoint_selection = 0;
+    bool adaptive_budget = false;
+
     /**
      * Method defining the feature detector to use.
      */
@@ -108,6 +151,57 @@ protected:
      */
     void prepareShifts(std::vector<cv::Mat> *draw_destination);
 
+    /**
+     * Sort unordered images left to right. Images are described with VLAD signatures, each one is matched with its
+     * nearest candidates, and the strongest pairs place the images along the horizontal axis.
+     */
+    void sortImages();
+
+    /**
+     * Detect key points and compute descriptors for an image, if not done already.
+     * @param i Index of the image.
+     */
+    virtual void computeFeatures(int i);
+
+    /**
+     * Update the budget for the next images given how the last pair went.
+     * @param inlier_ratio Fraction of the candidate matches of the last pair that were RANSAC inliers.
+     */
+    void adaptBudget(double inlier_ratio);
+
+    /**
+     * @param points Key points found on an image. Replaced by the selected ones.
+     * @param budget How many points to keep at most.
+     * @param size Size of the image.
+     */
+    static void selectGrid(std::vector<cv::KeyPoint> &points, int budget, const cv::Size &size);
+
+    /**
+     * @param points Key points found on an image. Replaced by the selected ones.
+     * @param budget How many points to keep at most.
+     * @param size Size of the image.
+     */
+    static void selectANMS(std::vector<cv::KeyPoint> &points, int budget, const cv::Size &size);
+
+    /**
+     * Estimate the shift between an image and the next one. The default implementation matches features and keeps
+     * the average displacement of the RANSAC inliers.
+     * @param i Index of the left image of the pair.
+     * @param matches Destination for the matches used to compute the shift, drawn if requested.
+     * @return The displacement of the left image's points with respect to the right image's ones.
+     */
+    virtual cv::Point2d estimateShift(int i, std::vector<cv::DMatch> &matches);
+
+    /**
+     * Match the features of any two images.
+     * @param a Index of the first image.
+     * @param b Index of the second image.
+     * @param matches Destination for the RANSAC inliers.
+     * @param close_matches Destination for the matches that passed the distance ratio test.
+     * @return The average displacement of the inliers from image a to image b. Positive x if b is to the right.
+     */
+    cv::Point2d matchFeatures(int a, int b, std::vector<cv::DMatch> &matches, std::vector<cv::DMatch> &close_matches);
+
     /**
      * @param material_images Images to use when making the final result.
      * @param result_dest Where to store the result to avoid computing it again.
@@ -128,10 +222,31 @@ public:
 
     explicit SIFTPanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction = RIGHT);
 
+    /**
+     * Match compact descriptors instead of the full SIFT ones. See DescriptorCompressor.
+     * @param projection_file File with the projection to use. If it does not exist, the projection is learned from the
+     *        descriptors of these images and saved there.
+     * @param dimensions Dimensions kept when learning a new projection.
+     * @param quantize If true, a new projection also quantizes the descriptors to 8 bits.
+     */
+    void setCompactDescriptors(const std::string &projection_file, int dimensions = 32, bool quantize = true);
+
 protected:
 
+    std::string projection_file;
+    int compact_dimensions = 0;
+    bool compact_quantize = false;
+    DescriptorCompressor compressor;
+
     cv::Ptr<cv::Feature2D> getDetector() override;
 
+    void computeFeatures(int i) override;
+
+    /**
+     * Load the projection, or learn it from the descriptors of all images and save it.
+     */
+    void prepareCompressor();
+
 };
 
 
@@ -141,12 +256,63 @@ class ORBPanoramicImage : public PanoramicImage {
 
 public:
 
-    explicit ORBPanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction = RIGHT);
+    /**
+     * @param n_features Maximum number of features found by ORB on each image, before any budget is applied.
+     */
+    explicit ORBPanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio, int direction = RIGHT,
+                               int n_features = 5000);
 
 protected:
 
+    int n_features;
+
     cv::Ptr<cv::Feature2D> getDetector() override;
 
 };
 
+
+// Phase correlation ---
+
+/**
+ * Panoramic image for pure translations between adjacent images.
+ * Shifts are found with FFT phase correlation on the overlapping bands of each pair, falling back to SIFT matching when
+ * the correlation peak is too weak.
+ */
+class PhaseCorrelationPanoramicImage : public PanoramicImage {
+
+public:
+
+    /**
+     * @param overlap Expected overlap between adjacent images, as a fraction of their width. Sets the band width.
+     * @param pyramid_levels How many times the bands are halved before correlating them. 0 uses full resolution.
+     * @param min_response Pairs whose correlation response is below this value fall back to feature matching.
+     */
+    explicit PhaseCorrelationPanoramicImage(std::vector<cv::Mat> images, double half_fov, double dist_ratio,
+                                            int direction = RIGHT, double overlap = 0.5, int pyramid_levels = 1,
+                                            double min_response = 0.1);
+
+    /**
+     * @return The phase correlation response (confidence, between 0 and 1) found for each pair. Empty if the shifts
+     *         have not been computed yet.
+     */
+    std::vector<double> responses();
+
+protected:
+
+    double overlap;
+    int pyramid_levels;
+    double min_response;
+
+    // Correlation response for each pair.
+    std::vector<double> pair_responses;
+
+    /**
+     * Detector used for the pairs that fall back to feature matching.
+     */
+    cv::Ptr<cv::Feature2D> getDetector() override;
+
+    cv::Point2d estimateShift(int i, std::vector<cv::DMatch> &matches) override;
+
+};
+
 #endif